@@ -1,104 +1,118 @@
 #include <avr/pgmspace.h>
 
-////////////////////////////////////////////////////////////////
-// Some useful long constants, that are stored in variables
-// because of bug in avr-gcc with long constants
-long c2 = 2;
-long c9 = 9;
-long c10 = 10;
-long c90 = 90;
-long c180 = 180;
-long c270 = 270;
-long c360 = 360;
-long c5152 = 5152;
+#include "robot.h"
 
 // width of the robot in 1/10 of a millimiter.
 // (distance between the two weels)
-long robot_width = 820;
+long robot_width = ROBOT_WIDTH;
 
 ////////////////////////////////////////////////////////////////
-// trig tables.
-// sin and cos tables are in flash (program memory),
-// because they don't fit in 1K of RAM
-// lush: (for (i 0 359) (printf "%d, " (+ 1000 (* 1000 (sin (* i (/ 3.1415927 180)))))))
-const int sin_table[] PROGMEM= 
-  {1000, 1017, 1034, 1052, 1069, 1087, 1104, 1121, 1139, 1156, 1173,
-   1190, 1207, 1224, 1241, 1258, 1275, 1292, 1309, 1325, 1342, 1358,
-   1374, 1390, 1406, 1422, 1438, 1453, 1469, 1484, 1500, 1515, 1529,
-   1544, 1559, 1573, 1587, 1601, 1615, 1629, 1642, 1656, 1669, 1681,
-   1694, 1707, 1719, 1731, 1743, 1754, 1766, 1777, 1788, 1798, 1809,
-   1819, 1829, 1838, 1848, 1857, 1866, 1874, 1882, 1891, 1898, 1906,
-   1913, 1920, 1927, 1933, 1939, 1945, 1951, 1956, 1961, 1965, 1970,
-   1974, 1978, 1981, 1984, 1987, 1990, 1992, 1994, 1996, 1997, 1998,
-   1999, 1999, 1999, 1999, 1999, 1998, 1997, 1996, 1994, 1992, 1990,
-   1987, 1984, 1981, 1978, 1974, 1970, 1965, 1961, 1956, 1951, 1945,
-   1939, 1933, 1927, 1920, 1913, 1906, 1898, 1891, 1882, 1874, 1866,
-   1857, 1848, 1838, 1829, 1819, 1809, 1798, 1788, 1777, 1766, 1754,
-   1743, 1731, 1719, 1707, 1694, 1681, 1669, 1656, 1642, 1629, 1615,
-   1601, 1587, 1573, 1559, 1544, 1529, 1515, 1499, 1484, 1469, 1453,
-   1438, 1422, 1406, 1390, 1374, 1358, 1342, 1325, 1309, 1292, 1275,
-   1258, 1241, 1224, 1207, 1190, 1173, 1156, 1139, 1121, 1104, 1087,
-   1069, 1052, 1034, 1017, 999, 982, 965, 947, 930, 912, 895, 878, 860,
-   843, 826, 809, 792, 775, 758, 741, 724, 707, 690, 674, 657, 641, 625,
-   609, 593, 577, 561, 546, 530, 515, 499, 484, 470, 455, 440, 426, 412,
-   398, 384, 370, 357, 343, 330, 318, 305, 292, 280, 268, 256, 245, 233,
-   222, 211, 201, 190, 180, 170, 161, 151, 142, 133, 125, 117, 108, 101,
-   93, 86, 79, 72, 66, 60, 54, 48, 43, 38, 34, 29, 25, 21, 18, 15, 12, 9,
-   7, 5, 3, 2, 1, 0, 0, 0, 0, 0, 1, 2, 3, 5, 7, 9, 12, 15, 18, 21, 25,
-   29, 34, 38, 43, 48, 54, 60, 66, 72, 79, 86, 93, 101, 108, 117, 125,
-   133, 142, 151, 161, 170, 180, 190, 201, 211, 222, 233, 245, 256, 268,
-   280, 292, 305, 318, 330, 343, 357, 370, 384, 398, 412, 426, 440, 455,
-   470, 484, 500, 515, 530, 546, 561, 577, 593, 609, 625, 641, 657, 674,
-   690, 707, 724, 741, 758, 775, 792, 809, 826, 843, 860, 878, 895, 912,
-   930, 947, 965, 982
-  };
-
-// (for (i 0 359) (printf "%d, " (+ 1000 (* 1000 (cos (* i (/ 3.1415927 180)))))))
-const int cos_table[] PROGMEM= 
-  {2000, 1999, 1999, 1998, 1997, 1996, 1994, 1992, 1990, 1987, 1984,
-   1981, 1978, 1974, 1970, 1965, 1961, 1956, 1951, 1945, 1939, 1933,
-   1927, 1920, 1913, 1906, 1898, 1891, 1882, 1874, 1866, 1857, 1848,
-   1838, 1829, 1819, 1809, 1798, 1788, 1777, 1766, 1754, 1743, 1731,
-   1719, 1707, 1694, 1681, 1669, 1656, 1642, 1629, 1615, 1601, 1587,
-   1573, 1559, 1544, 1529, 1515, 1499, 1484, 1469, 1453, 1438, 1422,
-   1406, 1390, 1374, 1358, 1342, 1325, 1309, 1292, 1275, 1258, 1241,
-   1224, 1207, 1190, 1173, 1156, 1139, 1121, 1104, 1087, 1069, 1052,
-   1034, 1017, 999, 982, 965, 947, 930, 912, 895, 878, 860, 843, 826,
-   809, 792, 775, 758, 741, 724, 707, 690, 674, 657, 641, 625, 609, 593,
-   577, 561, 546, 530, 515, 499, 484, 470, 455, 440, 426, 412, 398, 384,
-   370, 357, 343, 330, 318, 305, 292, 280, 268, 256, 245, 233, 222, 211,
-   201, 190, 180, 170, 161, 151, 142, 133, 125, 117, 108, 101, 93, 86,
-   79, 72, 66, 60, 54, 48, 43, 38, 34, 29, 25, 21, 18, 15, 12, 9, 7, 5,
-   3, 2, 1, 0, 0, 0, 0, 0, 1, 2, 3, 5, 7, 9, 12, 15, 18, 21, 25, 29, 34,
-   38, 43, 48, 54, 60, 66, 72, 79, 86, 93, 101, 108, 117, 125, 133, 142,
-   151, 161, 170, 180, 190, 201, 211, 222, 233, 245, 256, 268, 280, 292,
-   305, 318, 330, 343, 357, 370, 384, 398, 412, 426, 440, 455, 470, 484,
-   500, 515, 530, 546, 561, 577, 593, 609, 625, 641, 657, 674, 690, 707,
-   724, 741, 758, 775, 792, 809, 826, 843, 860, 878, 895, 912, 930, 947,
-   965, 982, 1000, 1017, 1034, 1052, 1069, 1087, 1104, 1121, 1139, 1156,
-   1173, 1190, 1207, 1224, 1241, 1258, 1275, 1292, 1309, 1325, 1342,
-   1358, 1374, 1390, 1406, 1422, 1438, 1453, 1469, 1484, 1500, 1515,
-   1529, 1544, 1559, 1573, 1587, 1601, 1615, 1629, 1642, 1656, 1669,
-   1681, 1694, 1707, 1719, 1731, 1743, 1754, 1766, 1777, 1788, 1798,
-   1809, 1819, 1829, 1838, 1848, 1857, 1866, 1874, 1882, 1891, 1898,
-   1906, 1913, 1920, 1927, 1933, 1939, 1945, 1951, 1956, 1961, 1965,
-   1970, 1974, 1978, 1981, 1984, 1987, 1990, 1992, 1994, 1996, 1997,
-   1998, 1999, 1999 };
-
+// trig table.
+// A quarter sine wave in flash (program memory): 129 points from
+// 0 to 90 degrees in Q14 (16384 is 1.0). The other quadrants are
+// mirrored from it and the points are linearly interpolated. In
+// 258 bytes instead of 1440, the error on milli-degree angles is
+// about 2/16384 (the old whole degree tables were off by 18/1000).
+// python: [round(16384*sin(i*pi/256)) for i in range(129)]
+#define TRIG_ONE 16384
+const int quarter_sin_table[] PROGMEM=
+  {0, 201, 402, 603, 804, 1005, 1205, 1406, 1606, 1806, 2006, 2205,
+   2404, 2603, 2801, 2999, 3196, 3393, 3590, 3786, 3981, 4176, 4370,
+   4563, 4756, 4948, 5139, 5330, 5520, 5708, 5897, 6084, 6270, 6455,
+   6639, 6823, 7005, 7186, 7366, 7545, 7723, 7900, 8076, 8250, 8423,
+   8595, 8765, 8935, 9102, 9269, 9434, 9598, 9760, 9921, 10080,
+   10238, 10394, 10549, 10702, 10853, 11003, 11151, 11297, 11442,
+   11585, 11727, 11866, 12004, 12140, 12274, 12406, 12537, 12665,
+   12792, 12916, 13039, 13160, 13279, 13395, 13510, 13623, 13733,
+   13842, 13949, 14053, 14155, 14256, 14354, 14449, 14543, 14635,
+   14724, 14811, 14896, 14978, 15059, 15137, 15213, 15286, 15357,
+   15426, 15493, 15557, 15619, 15679, 15736, 15791, 15843, 15893,
+   15941, 15986, 16029, 16069, 16107, 16143, 16176, 16207, 16235,
+   16261, 16284, 16305, 16324, 16340, 16353, 16364, 16373, 16379,
+   16383, 16384};
 
 ////////////////////////////////////////////////////////////////
 // Trig functions
+// Angles are binary angles (65536 to a full turn), so reducing
+// an angle to a quadrant and table slot is a couple of shifts
+// and every call takes the same time.
+
+// return TRIG_ONE*sin(angle) where angle is a binary angle
+int sin_bam(unsigned int angle) {
+  unsigned int x = angle & 0x3fff;      // position within the quadrant
+  if (angle & 0x4000) x = 0x4000 - x;   // 2nd and 4th quadrant run backwards
+  unsigned char i = x >> 7;
+  int lo = (int)pgm_read_word(quarter_sin_table + i);
+  int r = lo;
+  if (i < 128) {
+    int hi = (int)pgm_read_word(quarter_sin_table + i + 1);
+    r += ((hi - lo) * (int)(x & 0x7f)) >> 7;
+  }
+  return (angle & 0x8000) ? -r : r;
+}
+
+// return TRIG_ONE*cos(angle) where angle is a binary angle
+int cos_bam(unsigned int angle) {
+  return sin_bam(angle + 0x4000);
+}
+
+// converts an angle in 1/1000 of a degree to a binary angle
+unsigned int mdeg2bam(long angle) {
+  angle %= 360000L;
+  if (angle < 0) angle += 360000L;
+  // angle*65536/360000 rounded, split so the products fit 32 bits:
+  // 256*65536/360000 is 3054199/65536 and 65536/360000 is 11930/65536
+  unsigned long hi = (unsigned long)(angle >> 8) * 3054199;
+  unsigned long lo = (unsigned long)(angle & 0xff) * 11930;
+  return (unsigned int)((hi + lo + 0x8000) >> 16);
+}
+
+// return TRIG_ONE*sin(angle) where angle is in 1/1000 of a degree
+int SinMilli(long angle) { return sin_bam(mdeg2bam(angle)); }
+
+// return TRIG_ONE*cos(angle) where angle is in 1/1000 of a degree
+int CosMilli(long angle) { return cos_bam(mdeg2bam(angle)); }
 
 // return 1000*sin(angle) where angle is an integer angle in degrees
 long Sin(long angle) {
-  while (angle < 0) angle += c360;
-  return  (long)( (int)pgm_read_word(sin_table + (angle % c360)) - 1000 );
+  return ((long)SinMilli(angle*1000)*1000 + TRIG_ONE/2) >> 14;
 }
 
 // return 1000*cos(angle) where angle is an integer angle in degrees
 long Cos(long angle) {
-  while (angle < 0) angle += c360;
-  return (long)( (int)pgm_read_word(cos_table + (angle % c360)) - 1000 );
+  return ((long)CosMilli(angle*1000)*1000 + TRIG_ONE/2) >> 14;
+}
+
+// atan(i/32) in 1/1000 of a degree, for i from 0 to 32
+// python: [round(1000*degrees(atan(i/32))) for i in range(33)]
+const unsigned int atan_table[] PROGMEM=
+  {0, 1790, 3576, 5356, 7125, 8881, 10620, 12339, 14036, 15709,
+   17354, 18970, 20556, 22109, 23629, 25115, 26565, 27979, 29358,
+   30700, 32005, 33275, 34509, 35707, 36870, 37999, 39094, 40156,
+   41186, 42184, 43152, 44091, 45000};
+
+// return the heading of the vector (x,y) in 1/1000 of a degree,
+// clockwise from +y like the odometry, between -180000 and 180000.
+// One division for the octant ratio, then the table is interpolated
+// (within 0.02 degree). |x| and |y| must stay below 2^20.
+long Atan2Milli(long x, long y) {
+  unsigned long ax = (x < 0) ? -x : x;
+  unsigned long ay = (y < 0) ? -y : y;
+  unsigned long big = (ax > ay) ? ax : ay;
+  unsigned int t, i, lo, hi;
+  long a;
+  if (big == 0) return 0;
+  t = (unsigned int)((((ax > ay) ? ay : ax) << 12) / big); // 0 to 4096
+  i = t >> 7;
+  lo = pgm_read_word(atan_table + i);
+  a = lo;
+  if (i < 32) {
+    hi = pgm_read_word(atan_table + i + 1);
+    a += ((long)(hi - lo) * (t & 127)) >> 7;
+  }
+  if (ax > ay) a = 90000 - a;
+  if (y < 0) a = 180000 - a;
+  return (x < 0) ? -a : a;
 }
 
 ////////////////////////////////////////////////////////////////
@@ -119,7 +133,7 @@ long original_motor2speed(int v) {
   // v*4.7682 - 33 mm/s
   // This is robot 493 with fully charged batteries.
   // your mileage (millimeterage) may vary
-  int r = ( (v>0)?v:-v )*238/5 - 330;
+  int r = (long)( (v>0)?v:-v )*238/5 - 330;
   r = (r>0)?r:0;
   if (v>=0) {
     return (long)(r);
@@ -138,7 +152,7 @@ long original_motor2angle(int ml, int mr) {
   // w: width of the robot in 1/10th of mm
   long vl = original_motor2speed(ml);
   long vr = original_motor2speed(mr);
-  return (vl-vr)*c360/c5152;
+  return (vl-vr)*360/5152;
 }
 
 
@@ -152,7 +166,7 @@ long original_motor2angle(int ml, int mr) {
 // the number of degrees turned in 1 second when the
 // robot is turning in place.
 // THERE IS NO REAL REASON TO USE THIS FUNCTION
-// rather than motor2angle().
+// rather than original_motor2angle().
 long motor2angle_inplace(int v) {
   // a = v*6.5632 - 39.6316
   // This is robot 493 with fully charged batteries.
@@ -1,36 +1,282 @@
 #include <avr/pgmspace.h>
+#include <pololu/3pi.h>
 #include "3pi_kinematics.h"
 
-//Constants used in m2s calculations
-long calibration_distance = 2000; //Unit: .1mm
-long cM2S_Num = 238;
-long cM2S_Denom = 5;
-long cM2S_Intercept = -330;
+long calibration_distance = 2000; //Unit: .1mm, between the speed test's gaps
 
-long motor2speed(int v) {
-  long r = ( (v>0)? v : -v ) * cM2S_Num/cM2S_Denom + cM2S_Intercept;
-  r = (r>0) ? r : 0;
-  if (v>=0) {
-    return (r);
-  } else {
-    return (-r);
+////////////////////////////////////////////////////////////////
+// Per-wheel speed tables
+// What the pose needs on every step, the speed of each wheel for its
+// command, comes from a table per wheel instead of a 32-bit multiply
+// and divide. A table holds the speed (0.1 mm/s) at
+// commands 0, 16, ... 256 and is read with linear interpolation in
+// between, all in 16 bits: 17 points per wheel rather than 256, which
+// would take half of the RAM. The points are not clipped to the dead
+// band, the reads are, so a straight line is read back exactly.
+// wheel_base[] holds the wheels at battery_ref_mv, as calibrated and
+// saved; wheel_lut[] the same with the battery folded in, rebuilt by
+// wheel_refresh() whenever either changes.
+#define WHEEL_LEFT 0
+#define WHEEL_RIGHT 1
+#define WHEEL_SHIFT 4
+#define WHEEL_MASK ((1 << WHEEL_SHIFT) - 1)
+#define WHEEL_POINTS ((256 >> WHEEL_SHIFT) + 1)
+
+int wheel_base[2][WHEEL_POINTS];
+int wheel_lut[2][WHEEL_POINTS];
+long battery_scale = 4096;    // battery_mv/battery_ref_mv, Q12, 1 unless BATTERY_COMP, see below
+
+// A table through the line speed = c*num/denom + intercept.
+void wheel_build_line(int *t, long num, long denom, long intercept) {
+  unsigned char i;
+  for (i=0; i<WHEEL_POINTS; i++) {
+    t[i] = (((long)(i << WHEEL_SHIFT)*16*num/denom + 8) >> 4) + intercept;
+  }
+}
+
+// Folds the battery into wheel_lut[]: each point is wheel_base[] read
+// at the command it amounts to at battery_ref_mv.
+void wheel_refresh() {
+  unsigned char w, i, j;
+  long c, f;
+  for (w=0; w<2; w++) {
+    for (i=0; i<WHEEL_POINTS; i++) {
+      c = ((long)(i << WHEEL_SHIFT)*battery_scale) >> 8; // Q4
+      j = c >> (WHEEL_SHIFT + 4);
+      if (j > WHEEL_POINTS-2) { j = WHEEL_POINTS-2; }
+      f = c - ((long)j << (WHEEL_SHIFT + 4));
+      f = (wheel_base[w][j+1] - wheel_base[w][j])*f + (1L << (WHEEL_SHIFT + 3));
+      wheel_lut[w][i] = wheel_base[w][j] + (f >> (WHEEL_SHIFT + 4));
+    }
   }
 }
 
-long motor2angle(int left_motor, int right_motor) {
-  long left_vel = motor2speed(left_motor);
-  long right_vel = motor2speed(right_motor);
-  return (left_vel-right_vel)*c360/c5152;
+// Speed from a table for a command of 0-255.
+int wheel_read(const int *t, unsigned char c) {
+  int s = t[c >> WHEEL_SHIFT];
+  s += ((t[(c >> WHEEL_SHIFT) + 1] - s)*(c & WHEEL_MASK) + (1 << (WHEEL_SHIFT-1))) >> WHEEL_SHIFT;
+  return (s > 0) ? s : 0;
+}
+
+// Speed of a wheel (0.1 mm/s) for a motor command.
+int wheel_speed(unsigned char wheel, int v) {
+  if (v >= 0) { return wheel_read(wheel_lut[wheel], (v > 255) ? 255 : v); }
+  return -wheel_read(wheel_lut[wheel], (v < -255) ? 255 : -v);
+}
+
+// Both wheels from the robot profile's motor model (robot.h), until
+// something better is known.
+void wheel_init() {
+  wheel_build_line(wheel_base[WHEEL_LEFT], ROBOT_M2S_NUM, ROBOT_M2S_DENOM, ROBOT_M2S_INTERCEPT);
+  wheel_build_line(wheel_base[WHEEL_RIGHT], ROBOT_M2S_NUM, ROBOT_M2S_DENOM, ROBOT_M2S_INTERCEPT);
+  wheel_refresh();
+}
+
+////////////////////////////////////////////////////////////////
+// Wheel lag
+// How quickly each wheel takes up the speed of a new command: the
+// time constant of the first order lag pose.h models it with. The
+// speed test measures it (cal_lag() in dead.c); until then both
+// wheels get WHEEL_TAU_MS, which is what the simulator runs with and
+// has not been checked against a robot.
+#define WHEEL_TAU_MS 60
+#define WHEEL_TAU_MIN 20        // pose.h's series for the lag needs tau well over a step
+#define WHEEL_TAU_MAX 250
+
+unsigned int wheel_tau_ms[2] = {WHEEL_TAU_MS, WHEEL_TAU_MS};
+
+////////////////////////////////////////////////////////////////
+// Battery compensation
+// The speed for a command scales with the motor supply. On the 3pi
+// that is the 9.25 V boost regulator, not the battery, so it holds
+// while the regulator does and the compensation is left out: the
+// battery is only read for telemetry.h. Build with -DBATTERY_COMP=1
+// for motors that run straight off the battery; the commands are
+// then scaled by the battery voltage over the voltage the model was
+// fitted at before going through it. The friction term (the
+// intercept) doesn't change with the supply.
+#ifndef BATTERY_COMP
+#define BATTERY_COMP 0
+#endif
+
+long battery_ref_mv = ROBOT_REF_MV; // the model above holds at this voltage
+long battery_mv = 0;          // filtered reading, 0 before the first
+long battery_read = 0;        // and the last one as it came, for telemetry.h
+
+// Reads the battery, about 1 ms. Run it now and then.
+void battery_update() {
+  long mv = read_battery_millivolts();
+  battery_read = mv;
+  battery_mv = battery_mv ? battery_mv + (mv - battery_mv)/4 : mv;
+#if BATTERY_COMP
+  battery_scale = (battery_mv << 12)/battery_ref_mv;
+  wheel_refresh();
+#endif
+}
+
+// A command as it would be at battery_ref_mv, Q4.
+long battery_command(int v) {
+  return ((long)((v>0)? v : -v)*battery_scale) >> 8;
 }
 
-//Units are 3pi_speed x2, milliseconds x2
-void update_calibration(int speed_one, int speed_two, int time_one, int time_two){
-  long slope_numerator = calibration_distance*1000;
-  long slope_denom = (speed_two - speed_one)*(time_two - time_one);
-  long intercept = (calibration_distance/time_one)-(speed_one*slope_numerator/slope_denom);
+////////////////////////////////////////////////////////////////
+// Wheel base
+// robot_width (3pi_kinematics.h) is the effective distance between
+// the wheels' contact points, which the turn rate of the pose comes
+// from; the speed test measures it by timing turns in place. pose.h
+// takes it up at pose_init().
+void width_set(long w) {
+  robot_width = w;
+}
+
+// The width that makes turns of the wheels at +-command take time
+// (0.1 ms) for the given number of whole turns in place: the sum of
+// the wheel speeds over the turn rate, (vl+vr)*time/(2 pi turns).
+long spin_width(int command, long time, unsigned char turns) {
+  long v = wheel_speed(WHEEL_LEFT, command) + wheel_speed(WHEEL_RIGHT, command);
+  return (v*time + 31416L*turns)/(62832L*turns);
+}
 
-  cM2S_Num = slope_numerator; //Unit: .1mm*1k
-  cM2S_Denom = slope_denom;   //Unit: 3pi_spd*sec/1k
-  cM2S_Intercept = intercept; //Unit: .1mm/sec
-  return;
+// A table through the least-squares line of n >= 2 measured points,
+// commands in Q4 (battery_command()), and returns its slope, 0.1 mm/s
+// per Q4 command in Q12. The sums are taken around the mean point,
+// which keeps them in 32 bits for commands spread over up to 100 or
+// so and n up to 16. Returns 0 and leaves t alone if the commands
+// are all alike.
+long wheel_build_fit(int *t, unsigned char n, const long *command, const long *speed) {
+  long mc = 0, mv = 0, sxx = 0, sxy = 0, dc, slope;
+  unsigned char i;
+  for (i=0; i<n; i++) {
+    mc += command[i];
+    mv += speed[i];
+  }
+  mc /= n;
+  mv /= n;
+  for (i=0; i<n; i++) {
+    dc = command[i] - mc;
+    sxx += dc*dc;
+    sxy += dc*(speed[i] - mv);
+  }
+  if ((sxx >> 6) == 0) { return 0; }
+  slope = (sxy << 6)/(sxx >> 6);
+  for (i=0; i<WHEEL_POINTS; i++) {
+    dc = ((long)(i << WHEEL_SHIFT) << 4) - mc;
+    t[i] = mv + ((dc*slope + 2048) >> 12);
+  }
+  return slope;
+}
+
+// The speed test: n speeds (0.1 mm/s) timed over calibration_distance,
+// each at a mean command of the two wheels (Q4, battery_command()),
+// and how much faster than their mean the left wheel went, and the
+// right one slower (Q12). Each wheel gets the least-squares line
+// through its share of the speeds. Returns 0, changing nothing, if
+// the points don't make a line.
+unsigned char update_calibration(unsigned char n, const long *command, const long *speed, long asym) {
+  int t[WHEEL_POINTS];
+  long slope;
+  unsigned char i;
+  slope = (n < 2) ? 0 : wheel_build_fit(t, n, command, speed);
+  if (slope <= 0 || asym > 409 || asym < -409) { return 0; }   // 10%
+  for (i=0; i<WHEEL_POINTS; i++) {
+    wheel_base[WHEEL_LEFT][i] = ((long)t[i]*(4096 + asym) + 2048) >> 12;
+    wheel_base[WHEEL_RIGHT][i] = ((long)t[i]*(4096 - asym) + 2048) >> 12;
+  }
+  wheel_refresh();
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////
+// Refining the model on the run
+// Recursive least squares with forgetting, on speeds measured over a
+// known distance (see the speed marks in dead.c) against the mean
+// battery-compensated command of the two wheels. The line is parameterised around
+// command 128, as speed = t1*(c-128)/128 + t2, which keeps the
+// regressor within +-1 and all the products in 32 bits. theta is in
+// 0.1 mm/s Q4, the covariance P in Q14.
+// Most of what goes wrong with the model is a scale (the wheels, the
+// gearboxes), so P starts out mostly along theta itself: a run at one
+// speed, where only t2 could be learnt otherwise, scales t1 with it.
+// P is kept under its starting trace so that such a run can't wind
+// it up; forgetting only applies below that.
+// The marks only tell how fast the robot went, not how each wheel
+// did (the heading wanders by a degree or so between them, which is
+// a percent on each wheel), so the wheels keep the difference they
+// were calibrated with and are moved together.
+#define RLS_C0 128
+#define RLS_LAMBDA 15565        // forgetting factor 0.95, Q14
+#define RLS_P0 16384            // 1.0, Q14, along theta
+#define RLS_P0_FREE 2048        // and the rest
+#define RLS_MAX_ERROR 32767     // 205 mm/s, measurements further off are dropped
+
+long rls_theta[2];              // t1, t2
+long rls_p[3];                  // P11, P12, P22
+long rls_trace;                 // P11 + P22 at the start
+unsigned int rls_updates;
+
+// Speed on the line theta at table point i
+int rls_point(const long *theta, unsigned char i) {
+  return (theta[0]*((i << WHEEL_SHIFT) - RLS_C0)/RLS_C0 + theta[1] + 8) >> 4;
+}
+
+// Starts from the line through the mean of the wheel tables at
+// commands 128 and 256, with P0 as the confidence in it.
+void rls_init() {
+  long r;
+  rls_theta[1] = ((long)wheel_base[WHEEL_LEFT][RLS_C0 >> WHEEL_SHIFT] + wheel_base[WHEEL_RIGHT][RLS_C0 >> WHEEL_SHIFT]) << 3;
+  rls_theta[0] = (((long)wheel_base[WHEEL_LEFT][2*RLS_C0 >> WHEEL_SHIFT] + wheel_base[WHEEL_RIGHT][2*RLS_C0 >> WHEEL_SHIFT]) << 3) - rls_theta[1];
+  // P0 (t t')/t2^2, through r = t1/t2 in Q14
+  r = (rls_theta[1] > 16) ? (rls_theta[0] << 10)/(rls_theta[1] >> 4) : 1L << 14;
+  rls_p[1] = RLS_P0*r >> 14;
+  rls_p[0] = (rls_p[1]*r >> 14) + RLS_P0_FREE;
+  rls_p[2] = RLS_P0 + RLS_P0_FREE;
+  rls_trace = rls_p[0] + rls_p[2];
+  rls_updates = 0;
+}
+
+// Takes in a speed (0.1 mm/s) measured at a mean command (Q4, from
+// battery_command()) and moves both wheel tables by what that
+// changed of the line. Returns 0 if the measurement was dropped.
+unsigned char rls_update(long command, long speed) {
+  long f1 = (command - RLS_C0*16)/8;   // regressor, Q8
+  long f2 = 256;
+  long e, g1, g2, s, k1, k2, p0, p1, p2, old[2];
+  unsigned char i;
+  if (f1 > 256) { f1 = 256; }
+  if (f1 < -256) { f1 = -256; }
+  e = (speed << 4) - ((f1*rls_theta[0] + f2*rls_theta[1]) >> 8);
+  if (e > RLS_MAX_ERROR || e < -RLS_MAX_ERROR) { return 0; }
+
+  // gain k = P f/(lambda + f'P f)
+  g1 = (rls_p[0]*f1 + rls_p[1]*f2) >> 8;
+  g2 = (rls_p[1]*f1 + rls_p[2]*f2) >> 8;
+  s = RLS_LAMBDA + ((f1*g1 + f2*g2) >> 8);
+  k1 = (g1 << 14)/s;
+  k2 = (g2 << 14)/s;
+  old[0] = rls_theta[0];
+  old[1] = rls_theta[1];
+  rls_theta[0] += (k1*e) >> 14;
+  rls_theta[1] += (k2*e) >> 14;
+
+  // P = (P - k f'P)/lambda
+  p0 = rls_p[0] - ((k1*g1) >> 14);
+  p1 = rls_p[1] - ((k1*g2) >> 14);
+  p2 = rls_p[2] - ((k2*g2) >> 14);
+  if (p0 + p2 < rls_trace - (rls_trace >> 4)) {
+    p0 = (p0 << 14)/RLS_LAMBDA;
+    p1 = (p1 << 14)/RLS_LAMBDA;
+    p2 = (p2 << 14)/RLS_LAMBDA;
+  }
+  rls_p[0] = p0;
+  rls_p[1] = p1;
+  rls_p[2] = p2;
+  rls_updates++;
+
+  for (i=0; i<WHEEL_POINTS; i++) {
+    s = rls_point(rls_theta, i) - rls_point(old, i);
+    wheel_base[WHEEL_LEFT][i] += s;
+    wheel_base[WHEEL_RIGHT][i] += s;
+  }
+  wheel_refresh();
+  return 1;
 }
@@ -0,0 +1,104 @@
+#include <stddef.h>
+#include <avr/eeprom.h>
+
+////////////////////////////////////////////////////////////////
+// Calibration saved in EEPROM, so a robot that has been calibrated
+// once can skip the dance() and the speed test at boot, and keeps the
+// PID gains it tuned (pid.h).
+// The record starts with a magic number, a version and its own size,
+// and ends with a Fletcher-16 checksum. Anything that doesn't match
+// (blank EEPROM, an older layout, a write cut short by a reset) is
+// refused and the robot calibrates as it used to. Bump
+// CALSTORE_VERSION whenever the record changes.
+// Tuned gains are kept along with a check of the gains the firmware
+// was built with: after a new params.h is flashed they no longer
+// apply, and the built-in ones are used again.
+
+#define CALSTORE_ADDR ((void *)0x10)  // clear of address 0, the first to suffer from brown-outs
+#define CALSTORE_MAGIC 0x3370         // "p3"
+#define CALSTORE_VERSION 5
+
+typedef struct {
+	unsigned int magic;
+	unsigned char version;
+	unsigned char size;             // sizeof(calstore_record)
+	unsigned int minv[5];           // line sensor bounds
+	unsigned int maxv[5];
+	int wheel[2][WHEEL_POINTS];     // wheel speed tables at battery_ref_mv, see calibration.h
+	int width;                      // robot_width, 0.1 mm
+	unsigned char tau[2];           // wheel_tau_ms, up to WHEEL_TAU_MAX
+	unsigned char tuned;            // pid_tuned
+	unsigned int gains_check;       // calstore_gains_check() when they were tuned
+	pid_gains gains[PID_BANDS];     // pid_band_gains, those in tuned apply
+	unsigned int check;             // Fletcher-16 of all of the above
+} calstore_record;
+
+// Fletcher-16 of the first n bytes of a record
+unsigned int calstore_sum(const void *r, unsigned int n) {
+	const unsigned char *p = (const unsigned char *)r;
+	unsigned int a = 0, b = 0;
+	while (n--) {
+		a = (a + *p++) % 255;
+		b = (b + a) % 255;
+	}
+	return (b << 8) | a;
+}
+
+// The same of the gains pid.h is built with
+unsigned int calstore_gains_check() {
+	const pid_gains d[PID_BANDS] = PID_BAND_GAINS;
+	return calstore_sum(d, sizeof(d));
+}
+
+// Loads the saved calibration, returns 0 (and changes nothing) if
+// there is none.
+unsigned char calstore_load(unsigned int *minv, unsigned int *maxv) {
+	calstore_record r;
+	unsigned char i, w;
+	eeprom_read_block(&r, CALSTORE_ADDR, sizeof(r));
+	if (r.magic != CALSTORE_MAGIC || r.version != CALSTORE_VERSION
+	    || r.size != sizeof(r) || r.check != calstore_sum(&r, offsetof(calstore_record, check))) {
+		return 0;
+	}
+	for (i=0; i<5; i++) {
+		minv[i] = r.minv[i];
+		maxv[i] = r.maxv[i];
+	}
+	for (w=0; w<2; w++) {
+		for (i=0; i<WHEEL_POINTS; i++) { wheel_base[w][i] = r.wheel[w][i]; }
+	}
+	wheel_refresh();
+	width_set(r.width);
+	for (w=0; w<2; w++) { wheel_tau_ms[w] = r.tau[w]; }
+	if (r.gains_check == calstore_gains_check()) {
+		pid_tuned = r.tuned;
+		for (i=0; i<PID_BANDS; i++) {
+			if (pid_tuned & (1 << i)) { pid_band_gains[i] = r.gains[i]; }
+		}
+	}
+	return 1;
+}
+
+// Saves the current calibration. Only the bytes that changed are
+// written, at ~3.4 ms each.
+void calstore_save(const unsigned int *minv, const unsigned int *maxv) {
+	calstore_record r;
+	unsigned char i, w;
+	r.magic = CALSTORE_MAGIC;
+	r.version = CALSTORE_VERSION;
+	r.size = sizeof(r);
+	for (i=0; i<5; i++) {
+		r.minv[i] = minv[i];
+		r.maxv[i] = maxv[i];
+	}
+	for (w=0; w<2; w++) {
+		for (i=0; i<WHEEL_POINTS; i++) { r.wheel[w][i] = wheel_base[w][i]; }
+	}
+	r.width = robot_width;
+	for (w=0; w<2; w++) { r.tau[w] = wheel_tau_ms[w]; }
+	r.tuned = pid_tuned;
+	r.gains_check = calstore_gains_check();
+	for (i=0; i<PID_BANDS; i++) { r.gains[i] = pid_band_gains[i]; }
+	r.check = calstore_sum(&r, offsetof(calstore_record, check));
+	eeprom_update_block(&r, CALSTORE_ADDR, sizeof(r));
+}
@@ -5,11 +5,74 @@
 #include <pololu/3pi.h> // Required for all 3pi programs
 #include <avr/pgmspace.h> // Required for the use of program space for data
 #include "calibration.h" // Alters the standard behavior of the 3pi_kinematics.h file
+#include "scheduler.h" // Runs the control loop at a fixed rate
+#include "prof.h" // Cycle counts of the stages of the control step
+#include "qtr.h" // Line sensor reading in the background
+#include "display.h" // LCD output that never stalls the loop
+#include "params.h" // Tuned constants, see sim/sweep
+#include "pid.h" // Line following controller and its auto-tuning
+#include "calstore.h" // Calibration kept in EEPROM between boots
+#include "pose.h" // Dead reckoning
+#include "motors.h" // Slew limited motor commands
+#include "events.h" // Line ends, gaps, branches and marks, debounced over distance
+#include "trackmap.h" // Learnt map of the track and the speeds to take it at
+#include "telemetry.h" // Binary log of every control step on the serial port, after the state it logs
 
 #define MIN_MOTOR_SPEED 0
 #define MAX_MOTOR_SPEED 255
-#define MILLION 1000000
 #define DEBUG 1
+#define CONTROL_HZ 200 // control steps per second
+#define SENSOR_LEAD_US 1000 // each step's sensor frame is started this long before it
+#define TELEMETRY 1
+#define TUNE_RELAY 30 // relay auto-tuning output, motor units
+#define TUNE_HYST 50  // and hysteresis, position units
+
+// Going home, distances in 0.1 mm and angles in milli-degrees
+#define HOME_SPEED 40        // cruising motor command
+#define HOME_MIN_SPEED 20    // slowest approach the odometry still resolves at CONTROL_HZ
+#define HOME_PIVOT_SPEED 25  // motor command when turning in place
+#define HOME_PIVOT_ANGLE 45000 // turn in place while the origin is further off the nose
+#define HOME_SLOW_DIST 1500  // start slowing down 15 cm out
+#define HOME_TOLERANCE 50    // close enough, 5 mm
+#define HOME_MAX_STEPS (60*CONTROL_HZ) // give up after a minute
+
+// Sensor calibration (dance()) and tracking of the bounds while running,
+// in raw sensor units
+#define CAL_SPEED 40         // motor command while sweeping
+#define CAL_PERIOD_MS 5      // between frames
+#define CAL_MIN_RANGE 400    // a sensor spanning less hasn't seen the line yet
+#define CAL_SETTLE_SHIFT 4   // settled once a crossing moves its bounds by under 1/16 of its range
+#define CAL_MAX_FRAMES 500   // about 3 s, then it makes do
+#define CAL_CENTRE_SPEED 20  // and turning back onto the line
+#define CAL_CENTRE_LEAD 200  // position units short of the middle to stop at, it turns on a bit
+#define CAL_CENTRE_TOL 150   // close enough to the middle
+#define CAL_CENTRE_TRIES 3
+#define CAL_STOP_MS 100      // for the wheels to stop
+#define CAL_STEP_TICKS (2500000UL/CONTROL_HZ) // speed test control period
+#define CAL_TEST_SPEEDS 4    // base speeds of the speed test,
+#define CAL_TEST_FIRST 40    // from this one
+#define CAL_TEST_STEP 20     // up in these steps
+#define CAL_STRIP_MAX 20000  // 0.1 mm, no strip is longer than 2 m
+#define CAL_TURN_SPEED 30    // turning round at either end of it
+#define CAL_TURN_FRAMES 600  // 3 s to find the line again
+#define CAL_SPIN_LEAD 1500   // 0.1 mm back into the strip to spin at
+#define CAL_SPIN_SPEED 40    // motor command spinning in place
+#define CAL_SPIN_TURNS 2     // whole turns timed each way
+#define CAL_SPIN_SETTLE 60   // steps for the wheels to come up to speed first
+#define CAL_SPIN_STEPS 1600  // 8 s, then it gives up
+#define CAL_LAG_FAST 120     // pivoting on one wheel, the other one's command up to the stop
+#define CAL_LAG_SLOW 40      // and after it
+#define CAL_LAG_STOP_MS 500  // standing still in between
+#define TRACK_WINDOW_SHIFT 2 // readings further out than 1/4 of the range are spikes,
+#define TRACK_OUT_SHIFT 2    // the others move a bound out by 1/4 of the way
+#define TRACK_IN_SHIFT 8     // and back in by 1/256
+#define TRACK_REFRESH_MS 100 // scales and thresholds follow the bounds this often
+
+// Speed marks: cross marks across the line, in pairs MARK_SPACING apart
+#define MARK_SPACING 2000    // 0.1 mm between the leading edges
+#define MARK_MAX_TURN 10000  // milli-degrees, the pair must be on a straight
+#define MARK_STEADY (4 << 4) // battery_command() Q4, and at a steady speed
+#define MARK_SETTLE 500000UL // ticks (200 ms) it has to have been steady before the first
 
 // Global arrays to hold min and max sensor values for calibration
 unsigned int sensors[5]; // global array to hold sensor values
@@ -17,15 +80,41 @@ unsigned int minv[5] = {65000, 65000, 65000, 65000, 65000};
 unsigned int maxv[5] = {0};
 
 // Global for robot base motor setting
-int rotation = 40;
+int rotation = BASE_SPEED;
+
+// Sensor readings below this % of the calibrated range are off the line
+unsigned char line_threshold_pct = LINE_THRESHOLD;
+
+// Line following controller. Pressing A while running measures new
+// gains for the current speed band: 1 when asked, 2 while measuring.
+pid_state line_pid;
+pid_tune line_tune;
+unsigned char tuning = 0;
+unsigned char gains_tuned = 0; // during this run, to be saved
+
+// Profiler report (prof.h): C pages through the stages on the LCD
+// and sends them all on the serial port
+#if PROFILE
+const char prof_names[] PROGMEM = "stpsenpospiddrvmrktellcd"; // 3 letters per stage
+unsigned char prof_page = 0;     // stage shown plus one, 0 for the usual debug screen
+unsigned char prof_sending = 0;  // stages still to send
+#endif
 
 // Global to track whether the robot is to be running in the main loop
 int run = 0; // if =1 run the robot, if =0 stop
 
-// Globals that track position relative to the robot boot location (origin)
+// Buttons down as check_buttons() last saw them
+unsigned char buttons_pressed = 0;
+
+// Globals that track position relative to the robot boot location (origin),
+// in 0.1 mm, copied from the pose estimate after every step
 long xPos = 0;
 long yPos = 0;
 
+// Heading and its change over the last step, in milli-degrees
+long theta = 0;
+long marginalTheta = 0;
+
 // A couple of simple tunes, stored in program space.
 const char welcome[] PROGMEM = ">g32>>c32";
 const char thank_you_music[] PROGMEM = ">>c32>g32";
@@ -47,7 +136,7 @@ void idle_until_button_pressed(button) {
 
 // helper functions
 void toggleRun() { run = 1-run; }
-void stop_motors() { set_motors(0,0); delay_ms(250);}
+void stop_motors() { set_motors(0,0); motor_stopped(); delay_ms(250);}
 
 // This function loads custom characters into the LCD. Up to 8
 // characters can be loaded; we use them for 6 levels of a bar graph
@@ -91,8 +180,8 @@ void display_bars(const unsigned int *s, const unsigned int *minv, const unsigne
 	for (i=0;i<5;i++) {
 		int c = ((int)s[i]-(int)minv[i])*9/((int)maxv[i]-(int)minv[i]);
 		c = (c<0)?0:(c>8)?8:c;
-		// if (i==0) { print_long(s[0]); print_long(c); }
-		print_character(display_characters[c]);
+		// if (i==0) { display_print_long(s[0]); display_print_long(c); }
+		display_print_character(display_characters[c]);
 	}
 }
 
@@ -105,329 +194,927 @@ void update_bounds(const unsigned int *s, unsigned int *minv, unsigned int *maxv
 	}
 }
 
-// Return line position
-long line_position() {
+// Calibration frozen at the end of dance(), and again every
+// TRACK_REFRESH_MS while track_bounds() moves the bounds. Turning the
+// bounds into per sensor reciprocal scales and thresholds keeps all
+// divisions out of the control loop: the ATmega328P has no divide
+// instruction, each 32-bit divide is a libgcc shift-and-subtract
+// loop, and the loop used to do up to 11 of them.
+unsigned long level_scale[5];   // 10*2^22/(maxv-minv), rounded up
+unsigned int line_threshold[5]; // first raw reading above line_threshold_pct of the range
+
+void freeze_calibration() {
 	int i;
-	long sum = 0;
-	long count = 0;
-	int adjustment[5] = {-1000, -500, 0, 500, 1000};
-	for (i = 0; i < 5; i++) {
-		long min = (long)minv[i];   // tiny efficiency gain here
-		long dist = (10*((long)sensors[i]-min))/((long)maxv[i]-min); // 0-100
-		sum += dist*adjustment[i];  // 0-100's weighted by adjustment amount
-		count += dist;              // sum of 0-100's
+	for (i=0; i<5; i++) {
+		long range = (long)maxv[i]-(long)minv[i];
+		if (range < 1) { range = 1; }
+		level_scale[i] = ((10L << 22) + range - 1)/range;
+		line_threshold[i] = minv[i] + ((line_threshold_pct+1)*range + 99)/100;
 	}
-	return sum/count; // between -1000 and +1000
 }
 
-// Returns 1 if off the line, 0 if on the line
-int off_track(center_only) {
-	int i = 0;
-	int count = 5;
-	if(center_only){ // Sets loop to look only at center sensor
-		i = 2;
-		count = 3;
+// Tracking the bounds while running. The floor and the tape read
+// differently as the ambient light changes, and the bounds of the
+// calibration only ever widened, so a single glare spike squeezed
+// every reading after it into part of the range. Instead the bounds
+// follow the readings that must be tape or floor: the strongest
+// sensor, if it is on the line, is on the tape (a sensor from its
+// middle at most, and the line is 19 mm wide); a sensor two or more
+// away from it, and not on the line itself, is 15 mm or more from the
+// middle, out on the floor. A reading past its bound pulls the bound
+// out by 1/4 of the way, unless it is out by more than 1/4 of the
+// range, a spike; a reading inside it lets the bound back in by 1/256
+// of the way, so the range keeps up with the light over a second or
+// so on the line.
+long track_lo[5], track_hi[5];  // minv and maxv, Q8
+
+void track_start() {
+	unsigned char i;
+	for (i=0; i<5; i++) {
+		track_lo[i] = (long)minv[i] << 8;
+		track_hi[i] = (long)maxv[i] << 8;
 	}
-	for(; i < count; i++){
-		int min = minv[i];
-		long dist = (100*((long)sensors[i]-min))/((long)maxv[i]-min); // 0-100
-		if (dist > 25) { return 0; } // Threshold for declaring not-a-line
+}
+
+// Moves a bound towards v. out is the sign of a move away from the
+// other bound.
+void track_bound(long *b, long v, long range, char out) {
+	long d = v - *b;
+	if ((out > 0) ? d > 0 : d < 0) {
+		if (d < (range >> TRACK_WINDOW_SHIFT) && d > -(range >> TRACK_WINDOW_SHIFT)) { *b += d >> TRACK_OUT_SHIFT; }
+	} else if (range > ((long)CAL_MIN_RANGE << 8)) {
+		*b += d >> TRACK_IN_SHIFT;
 	}
-	return 1; // Fell through the guard, thus off the line
 }
 
-// Calculates the time taken to travel a set distance
-// Currently assumed to be 20cm.
-int two_line_time(speed){
-	idle_until_button_pressed(BUTTON_A);
-	set_motors(speed, speed);
-	int speed_time = 0;
-	int first_mark_time = 0;
-	int second_mark_time = 0;
-
-	while(1) {
-		read_line_sensors(sensors, IR_EMITTERS_ON);
-		if(off_track(0) && !first_mark_time){
-			first_mark_time = millis();
-		} else if(off_track(0) && !second_mark_time && (millis()-first_mark_time > 2000)) {
-			second_mark_time = millis();
+void track_bounds(const unsigned int *s) {
+	unsigned char i, peak = 0;
+	for (i=1; i<5; i++) {
+		if ((int)(s[i] - minv[i]) > (int)(s[peak] - minv[peak])) { peak = i; }
+	}
+	for (i=0; i<5; i++) {
+		if (i == peak) {
+			if (s[i] < line_threshold[i]) { continue; }
+			track_bound(&track_hi[i], (long)s[i] << 8, track_hi[i] - track_lo[i], 1);
+		} else {
+			if (i + 1 >= peak && i <= peak + 1) { continue; }
+			if (s[i] >= line_threshold[i]) { continue; }
+			track_bound(&track_lo[i], (long)s[i] << 8, track_hi[i] - track_lo[i], -1);
+		}
+		minv[i] = track_lo[i] >> 8;
+		maxv[i] = track_hi[i] >> 8;
+	}
+}
+
+// Sensor reading between the frozen bounds, 0-1280
+unsigned int sensor_fraction(int i) {
+	long v = (long)sensors[i]-(long)minv[i];
+	if (v <= 0) { return 0; }
+	if (v >= (long)maxv[i]-(long)minv[i]) { return 1280; }
+	// same as 1280*v/(maxv-minv) while the range stays under 2048
+	return (v*level_scale[i]) >> 15;
+}
+
+// Line position, -1000 (under sensor 0, on the left) to 1000 (under
+// sensor 4), 500 per sensor. The peak of a parabola through the
+// strongest sensor and its neighbours (0 past the ends of the row)
+// places the line to a unit rather than the 50 or so of the 0-10
+// levels it used to be averaged from. Sensors saturated side by side
+// (the line is wider than their spacing) count as one peak in the
+// middle of them. Four or more on black is more than one line can
+// cover, a cross mark or a branch (see events.h), and the line is
+// taken to carry on where it was.
+// When no sensor sees the line, it is off the side it was last seen
+// on, LINE_LOST, and the robot steers back hard; unless it was last
+// seen near the middle, under a gap in the tape, which is driven
+// across on the last position.
+#define LINE_LOST 1500
+#define LINE_LOST_EDGE 500      // further out than this it went off the side
+
+int line_last = 0;              // last position the line was seen at
+
+// num/den in Q10 for a num of at most den/2, by shift and subtract:
+// cheaper than a libgcc divide, which the loop has none of
+unsigned int line_quotient(unsigned int num, unsigned int den) {
+	unsigned int q = 0;
+	unsigned char b;
+	for (b=0; b<10; b++) {
+		num <<= 1;
+		q <<= 1;
+		if (num >= den) {
+			num -= den;
+			q |= 1;
+		}
+	}
+	return q;
+}
+
+int line_position() {
+	unsigned int f[5], l, m, r, d;
+	unsigned char i, first = 0, last, seen = 0;
+	for (i=0; i<5; i++) {
+		f[i] = sensor_fraction(i);
+		if (f[i] > f[first]) { first = i; }
+		if (sensors[i] >= line_threshold[i]) { seen++; }
+	}
+	if (seen > 3) { return line_last; }
+	if (!seen) {
+		if (line_last > LINE_LOST_EDGE) { return LINE_LOST; }
+		if (line_last < -LINE_LOST_EDGE) { return -LINE_LOST; }
+		return line_last;
+	}
+	m = f[first];
+	for (last=first; last < 4 && f[last+1] == m; last++) {}
+	// vertex at (r-l)/(2(2m-l-r)) sensors from the peak, under half a
+	// sensor either way as m is the largest
+	l = first ? f[first-1] : 0;
+	r = (last < 4) ? f[last+1] : 0;
+	d = (r > l) ? r - l : l - r;
+	d = d ? (line_quotient(d, 4*m - 2*l - 2*r)*125 + 128) >> 8 : 0; // *500/1024
+	line_last = (first + last - 4)*250 + ((r > l) ? (int)d : -(int)d);
+	return line_last;
+}
+
+// Speed marks. Timing the leading edges of two cross marks a known
+// distance apart gives the speed actually driven between them, which
+// refines the wheel tables (rls_update() in calibration.h). The
+// odometry has to agree that the marks are about MARK_SPACING apart,
+// so a single mark or marks of different pairs are not mistaken for
+// a pair, and the robot must have gone straight between them, at a
+// command that has held since well before the first: the wheels lag
+// behind a change of speed (see the speed profile in trackmap.h), and
+// the timed speed would then not be that of the mean command.
+// A mark is an EV_CROSS of the line events (events.h), but its edge
+// is timed to a fraction of a step: the outer sensors only see black
+// on a mark, and the moment their mean level crosses half way is
+// interpolated between the frames around it. (A whole step is 0.6%
+// of the time between the marks at speed 60.)
+unsigned int mark_level;        // outer sensors in the previous frame, 0-2560
+unsigned long mark_frame;       // and its ticks
+unsigned long mark_edge;        // last half way crossing of the outer sensors
+long mark_edge_dist, mark_edge_theta;
+unsigned long mark_last;        // leading edge of the previous mark, 0 before the first
+long mark_dist, mark_theta;     // pose_dist and theta there
+long mark_command;              // battery_command() summed since then, Q4
+long mark_steady;               // command the speed has been steady at, Q4
+unsigned long mark_changed;     // frame ticks when it last moved by more than MARK_STEADY
+unsigned int mark_n;
+
+void speed_marks(int leftMotor, int rightMotor, unsigned char event) {
+	long d, turn, dt, speed;
+	long command = (battery_command(leftMotor) + battery_command(rightMotor))/2;
+	unsigned int level = sensor_fraction(0) + sensor_fraction(4);
+	mark_command += command;
+	if (command > mark_steady + MARK_STEADY || command < mark_steady - MARK_STEADY) {
+		mark_steady = command;
+		mark_changed = qtr_frame_ticks;
+	}
+	mark_n++;
+	if (mark_level < 1280 && level >= 1280 && mark_frame) {
+		mark_edge = mark_frame + (qtr_frame_ticks - mark_frame)*(1280 - mark_level)/(level - mark_level);
+		mark_edge_dist = pose_dist;
+		mark_edge_theta = theta;
+	}
+	mark_level = level;
+	mark_frame = qtr_frame_ticks;
+
+	if (event != EV_CROSS) { return; }
+
+	if (mark_last) {
+		d = (mark_edge_dist - mark_dist) >> POSE_FRAC;
+		turn = (mark_edge_theta - mark_theta) % 360000L;
+		if (turn > 180000) { turn -= 360000L; }
+		if (turn < -180000) { turn += 360000L; }
+		dt = ticks_to_microseconds(mark_edge - mark_last)/100;
+		if (d > MARK_SPACING*3/4 && d < MARK_SPACING*5/4 && turn < MARK_MAX_TURN && turn > -MARK_MAX_TURN
+		    && (long)(mark_last - mark_changed) > (long)MARK_SETTLE && dt > 0) {
+			speed = (long)MARK_SPACING*10000/dt; // 0.1 mm/s
+			rls_update(mark_command/mark_n, speed);
 		}
-		if (second_mark_time){
-			stop_motors();
-			speed_time = second_mark_time - first_mark_time;
-			break;
+	}
+	mark_last = mark_edge;
+	mark_dist = mark_edge_dist;
+	mark_theta = mark_edge_theta;
+	mark_command = 0;
+	mark_n = 0;
+}
+
+// Sets the motors, slew limited (see motors.h), after bringing the
+// pose up to now under the commands they had until then (see pose.h).
+void drive(int leftMotor, int rightMotor) {
+	long heading;
+	unsigned long now = get_ticks();
+	pose_advance(now);
+	motor_output(leftMotor, rightMotor, now);
+	pose_command(motor_left, motor_right);
+
+	xPos = pose_x >> POSE_FRAC;
+	yPos = pose_y >> POSE_FRAC;
+	heading = pose_heading_mdeg();
+	marginalTheta = heading - theta;
+	if (marginalTheta > 180000) { marginalTheta -= 360000L; }
+	if (marginalTheta < -180000) { marginalTheta += 360000L; }
+	theta = heading;
+}
+
+// Speed test on the calibration strip (see speed_calibrate()). It
+// runs before the scheduler does, so it paces itself at CONTROL_HZ.
+// Gap edges are timed to a fraction of a step, like the speed marks:
+// the moment the strongest sensor drops below half way, interpolated
+// between the frames around it.
+// cal_diff and cal_sum add up, every step, the speeds the wheel tables
+// give for the two commands sent, through the mean of the two tables:
+// their difference, which is how much the robot turned, and their sum.
+long cal_diff, cal_sum;
+long cal_edge_diff, cal_edge_sum; // as they were at the first gap of the last pass
+
+// Waits out the rest of the control period that started at *stamp.
+void cal_pace(unsigned long *stamp) {
+	unsigned long dt = get_ticks() - *stamp;
+	if (dt < CAL_STEP_TICKS) { delay_us(ticks_to_microseconds(CAL_STEP_TICKS - dt)); }
+	*stamp = get_ticks();
+}
+
+// drive(), adding the step to cal_diff and cal_sum.
+void cal_drive(int leftMotor, int rightMotor) {
+	long l, r;
+	drive(leftMotor, rightMotor);
+	l = (long)wheel_speed(WHEEL_LEFT, motor_left) + wheel_speed(WHEEL_RIGHT, motor_left);
+	r = (long)wheel_speed(WHEEL_LEFT, motor_right) + wheel_speed(WHEEL_RIGHT, motor_right);
+	cal_diff += l - r;
+	cal_sum += l + r;
+}
+
+// Follows the line at a base speed to the end of it, or for dist
+// (0.1 mm), and stops. If the leading edges of two gaps went by
+// about calibration_distance apart, returns 1 with the speed between
+// them (0.1 mm/s) and the mean command of the wheels meanwhile (Q4,
+// battery_command()).
+unsigned char cal_follow(int speed, long dist, long *command, long *v) {
+	ev_state ev;
+	unsigned char i, event, marks = 0;
+	unsigned int f, level, last_level = 0, n = 0;
+	unsigned long stamp, last_frame = 0, edge = 0, first = 0, last = 0;
+	long edge_dist = 0, first_dist = 0, d = 0, sum = 0;
+	int offset, leftMotor, rightMotor;
+
+	ev_reset(&ev);
+	pid_set_gains(&line_pid, &pid_band_gains[pid_band(speed)], MAX_MOTOR_SPEED);
+	pid_reset(&line_pid);
+	line_last = 0;
+	pose_init(get_ticks());
+	cal_edge_sum = 0;
+	stamp = get_ticks();
+	do {
+		cal_pace(&stamp);
+		qtr_read(sensors);
+		offset = pid_update(&line_pid, line_position());
+		leftMotor = speed + offset;
+		rightMotor = speed - offset;
+		leftMotor = (leftMotor > MAX_MOTOR_SPEED) ? MAX_MOTOR_SPEED : (leftMotor < MIN_MOTOR_SPEED) ? MIN_MOTOR_SPEED : leftMotor;
+		rightMotor = (rightMotor > MAX_MOTOR_SPEED) ? MAX_MOTOR_SPEED : (rightMotor < MIN_MOTOR_SPEED) ? MIN_MOTOR_SPEED : rightMotor;
+		cal_drive(leftMotor, rightMotor);
+
+		level = 0;
+		for (i=0; i<5; i++) {
+			f = sensor_fraction(i);
+			if (f > level) { level = f; }
+		}
+		if (last_level >= 640 && level < 640 && last_frame) {
+			edge = last_frame + (qtr_frame_ticks - last_frame)*(last_level - 640)/(last_level - level);
+			edge_dist = pose_dist >> POSE_FRAC;
+		}
+		last_level = level;
+		last_frame = qtr_frame_ticks;
+
+		event = ev_update(&ev, sensors, line_threshold, pose_dist >> POSE_FRAC, qtr_frame_ticks);
+		if (marks == 1) {
+			sum += battery_command(motor_left) + battery_command(motor_right);
+			n += 2;
 		}
+		if (event == EV_MARK && marks < 2) {
+			if (marks++) {
+				last = edge;
+				d = edge_dist - first_dist;
+			} else {
+				first = edge;
+				first_dist = edge_dist;
+				cal_edge_diff = cal_diff;
+				cal_edge_sum = cal_sum;
+			}
+		}
+	} while (event != EV_END && (pose_dist >> POSE_FRAC) < dist);
+	stop_motors();
+
+	if (marks < 2 || !n || d < calibration_distance*3/4 || d > calibration_distance*5/4) { return 0; }
+	d = ticks_to_microseconds(last - first)/100;
+	if (d <= 0) { return 0; }
+	*v = calibration_distance*10000/d;
+	*command = sum/n;
+	return 1;
+}
+
+// Turns round in place past the end of the strip, clockwise for dir
+// 1, until the line is back under the middle of the row. Returns 0 if
+// it isn't found.
+unsigned char cal_turn(int dir) {
+	unsigned int frames;
+	unsigned char on, off = 0;
+	unsigned long stamp = get_ticks();
+	for (frames=0; frames<CAL_TURN_FRAMES; frames++) {
+		cal_pace(&stamp);
+		cal_drive(dir*CAL_TURN_SPEED, -dir*CAL_TURN_SPEED);
+		qtr_read(sensors);
+		on = ev_sensors(sensors, line_threshold);
+		if (!on) { off = 1; }
+		if (on && off && dir*line_position() < CAL_CENTRE_LEAD) { break; }
 	}
-	return speed_time;
+	stop_motors();
+	return frames < CAL_TURN_FRAMES;
 }
 
-// Automatically determines values for motor2speed internal constants
-void speed_calibrate(int first_speed, int second_speed){
-	int first_speed_time;
-	int second_speed_time;
+// Spins in place over the middle of the strip, clockwise for dir 1,
+// and times CAL_SPIN_TURNS whole turns (0.1 ms) by the line crossing
+// the middle of the row. The line runs off both ways from under the
+// axle, so it crosses twice a turn and the same half of it every other
+// time, whatever the axle's offset from it. Returns 0 if the pose
+// doesn't agree that the crossings timed are the whole turns.
+long cal_spin(int dir) {
+	unsigned int steps;
+	unsigned char crossings = 0, on, seen = 0;
+	int position, last = 0;
+	unsigned long stamp, last_frame = 0, first = 0, at = 0;
+	long turned = 0;
+
+	pose_init(get_ticks());
+	theta = 0;
+	stamp = get_ticks();
+	for (steps=0; steps<CAL_SPIN_STEPS; steps++) {
+		cal_pace(&stamp);
+		qtr_read(sensors);
+		drive(dir*CAL_SPIN_SPEED, -dir*CAL_SPIN_SPEED);
+		turned += marginalTheta;
+		// turning right, the line moves towards sensor 0
+		on = ev_sensors(sensors, line_threshold) != 0;
+		if (on) {
+			position = dir*line_position();
+			if (seen && last > 0 && position <= 0 && steps >= CAL_SPIN_SETTLE) {
+				at = last_frame + (qtr_frame_ticks - last_frame)*last/(last - position);
+				if (!crossings++) {
+					first = at;
+					turned = 0;
+				} else if (crossings > 2*CAL_SPIN_TURNS) {
+					break;
+				}
+			}
+			last = position;
+		}
+		seen = on;
+		last_frame = qtr_frame_ticks;
+	}
+	stop_motors();
+
+	turned = dir*turned/CAL_SPIN_TURNS - 360000;
+	if (steps == CAL_SPIN_STEPS || turned > 90000 || turned < -90000) { return 0; }
+	return ticks_to_microseconds(at - first)/100;
+}
 
-	clear();
-	lcd_goto_xy(0,0);
-	print("Speed Test");
-	first_speed_time = two_line_time(first_speed);
+// Drives the motors at left and right until the line next crosses
+// the middle of the row the way a turn clockwise for dir 1 takes it
+// (see cal_spin()), n times, and returns when it last did (get_ticks()),
+// or 0 if that takes more than CAL_SPIN_STEPS.
+unsigned long cal_cross(int dir, int left, int right, unsigned char n) {
+	unsigned int steps;
+	unsigned char on, seen = 0;
+	int position, last = 0;
+	unsigned long stamp = get_ticks(), last_frame = 0;
+	for (steps=0; steps<CAL_SPIN_STEPS; steps++) {
+		cal_pace(&stamp);
+		qtr_read(sensors);
+		on = ev_sensors(sensors, line_threshold) != 0;
+		if (on) {
+			position = dir*line_position();
+			if (seen && last > 0 && position <= 0 && !--n) {
+				return last_frame + (qtr_frame_ticks - last_frame)*last/(last - position);
+			}
+			last = position;
+		}
+		seen = on;
+		last_frame = qtr_frame_ticks;
+		drive(left, right);
+	}
+	return 0;
+}
 
-	//requires a user rotate here
-	lcd_goto_xy(0,1);
-	print("Test 2");
-	second_speed_time = two_line_time(second_speed);
+// Measures wheel_tau_ms[wheel], pivoting on the other wheel over the
+// middle of the strip: a turn at CAL_LAG_FAST is stopped the moment
+// the line crosses (tc, the stop going out at ts), and restarted at
+// CAL_LAG_SLOW once the wheel has stopped. Under the lag the stop
+// coasts on for tau at the fast turn rate and the restart loses tau
+// at the slow one, so with r the ratio of the two rates the time from
+// the restart to the same crossing again is
+//   t = T2 - r (ts - tc) - (r - 1) tau
+// T1 and T2 being a whole turn at either rate, both timed too, r is
+// T2/T1. Returns 0, changing nothing, if a crossing didn't come or
+// tau doesn't come out between WHEEL_TAU_MIN and WHEEL_TAU_MAX.
+unsigned char cal_lag(unsigned char wheel) {
+	int dir = (wheel == WHEEL_LEFT) ? 1 : -1;
+	int left = (wheel == WHEEL_LEFT) ? 1 : 0;
+	unsigned long c0, c1, ts, tr, d0, d1;
+	long t1, t2, t, tau;
 
-	update_calibration(first_speed, second_speed, first_speed_time, second_speed_time);
+	// the line crosses twice a turn, the same half of it every other time
+	c0 = cal_cross(dir, left*CAL_LAG_FAST, (1-left)*CAL_LAG_FAST, 2);
+	c1 = cal_cross(dir, left*CAL_LAG_FAST, (1-left)*CAL_LAG_FAST, 2);
+	drive(0, 0);
+	ts = motor_stamp;
+	delay_ms(CAL_LAG_STOP_MS);
+	drive(left*CAL_LAG_SLOW, (1-left)*CAL_LAG_SLOW);
+	tr = motor_stamp;
+	d0 = cal_cross(dir, left*CAL_LAG_SLOW, (1-left)*CAL_LAG_SLOW, 2);
+	d1 = cal_cross(dir, left*CAL_LAG_SLOW, (1-left)*CAL_LAG_SLOW, 2);
+	stop_motors();
+	if (!c0 || !c1 || !d0 || !d1) { return 0; }
 
-	clear();
-	return;
+	// in 0.1 ms: tau = (T1 (T2 - t) - T2 (ts - tc))/(T2 - T1)
+	t1 = ticks_to_microseconds(c1 - c0)/100;
+	t2 = ticks_to_microseconds(d1 - d0)/100;
+	t = ticks_to_microseconds(d0 - tr)/100;
+	if (t2 <= t1 || t < t2/2) { return 0; }
+	tau = (t1*(t2 - t) - t2*(long)(ticks_to_microseconds(ts - c1)/100))/(t2 - t1);
+	tau = (tau + 5)/10;
+	if (tau < WHEEL_TAU_MIN || tau > WHEEL_TAU_MAX) { return 0; }
+	wheel_tau_ms[wheel] = tau;
+	return 1;
 }
 
-// Make a little dance: Turn left and right
+// Speed test. Put the robot on the calibration strip: a straight line
+// with the two calibration gaps, their leading edges
+// calibration_distance apart, and 25 cm or more of line on either
+// side; the robot at one end facing along it. Press A and it follows
+// the line at CAL_TEST_SPEEDS base speeds, each to the end of the
+// strip and back, turning round at the ends one way and then the
+// other. The gaps time the speed each way, which with the mean
+// command of the wheels meanwhile gives the points of a least-squares
+// line for the two wheels together.
+// How they differ comes from the whole run instead: the strip is
+// straight, so from the first gap on the first pass to the first gap
+// on the last pass out, the robot ends up facing the way it started,
+// the turns round having cancelled out. Whatever turn the mean table
+// makes of the commands over all that way (cal_diff) is then the
+// wheels' difference: a heading that is off by a degree or two at
+// either end is a few hundredths of a percent over the metres in
+// between. A single pass is too short for that, the steering weaves
+// by a degree or two between the gaps.
+// Last it spins in place over the middle of the strip, both ways, and
+// the time whole turns take at those wheel speeds gives robot_width;
+// then it pivots on each wheel in turn to time how the other takes up
+// a new command (cal_lag()).
+void speed_calibrate() {
+	long command[2*CAL_TEST_SPEEDS], speed[2*CAL_TEST_SPEEDS];
+	long t, w = 0, first_diff = 0, first_sum = 0, asym = 0;
+	unsigned char i, n = 0;
+	int dir;
+
+	display_clear();
+	display_print("Speed Test");
+	display_flush();
+	idle_until_button_pressed(BUTTON_A);
+	cal_diff = cal_sum = 0;
+	for (i=0; i<2*CAL_TEST_SPEEDS; i++) {
+		n += cal_follow(CAL_TEST_FIRST + (i >> 1)*CAL_TEST_STEP, CAL_STRIP_MAX, &command[n], &speed[n]);
+		if (i == 0) {
+			first_diff = cal_edge_diff;
+			first_sum = cal_edge_sum;
+		} else if (i == 2*CAL_TEST_SPEEDS-2 && first_sum && cal_edge_sum) {
+			t = (cal_edge_sum - first_sum) >> 12;
+			if (t > 0) { asym = -(cal_edge_diff - first_diff)/t; }
+		}
+		if (!cal_turn((i & 1) ? -1 : 1)) {
+			display_goto_xy(0,1);
+			display_print("No line");
+			display_flush();
+			return;
+		}
+	}
+	update_calibration(n, command, speed, asym);
+
+	cal_follow(CAL_TEST_FIRST, CAL_SPIN_LEAD, &command[0], &speed[0]);
+	for (dir=1; dir>=-1; dir-=2) {
+		t = cal_spin(dir);
+		if (!t) { continue; }
+		t = spin_width(CAL_SPIN_SPEED, t, CAL_SPIN_TURNS);
+		w = w ? (w + t)/2 : t;
+	}
+	if (w) { width_set(w); }
+	cal_lag(WHEEL_LEFT);
+	cal_lag(WHEEL_RIGHT);
+
+	display_clear();
+	display_flush();
+}
+
+// Sensor calibration: a little dance, turning left and right over the
+// line. Each sweep turns back as soon as the outer sensor on the side
+// the line moves to has been across it, and the dance is over once a
+// crossing of every sensor has moved its bounds by less than
+// 1/2^CAL_SETTLE_SHIFT of its range, which on a clean floor is three
+// short sweeps (the fixed dance took 1.6 s). Then it turns back onto
+// the line.
 void dance() {
-	int counter;
-	for(counter=0;counter<80;counter++) {
-		if(counter <= 20 || counter >= 60) { set_motors(40,-40);
-		} else { set_motors(-40,40); }
-		// Since our counter runs to 80, the total delay will be 80*20 = 1600 ms.
-		read_line_sensors(sensors, IR_EMITTERS_ON);
+	unsigned int frames, range, top[5], bottom[5]; // bounds when the crossing started
+	unsigned char i, on = 0, crossed = 0, settled = 0;
+	int dir = 1;                  // turning right, the line moves towards sensor 0
+	int moving = 1;               // the way it turned over the last frame
+	int position;
+
+	qtr_read(sensors);
+	for (i=0; i<5; i++) { minv[i] = maxv[i] = sensors[i]; }
+	set_motors(CAL_SPEED, -CAL_SPEED);
+	for (frames=0; frames<CAL_MAX_FRAMES && settled != 0x1f; frames++) {
+		delay_ms(CAL_PERIOD_MS);
+		qtr_read(sensors);
 		update_bounds(sensors,minv,maxv);
-		delay_ms(20);
+		moving = dir;
+		for (i=0; i<5; i++) {
+			range = maxv[i] - minv[i];
+			if (range < CAL_MIN_RANGE) { continue; }
+			if (!(on & (1 << i)) && sensors[i] > maxv[i] - range/4) {
+				on |= 1 << i;
+				top[i] = maxv[i];
+				bottom[i] = minv[i];
+			} else if ((on & (1 << i)) && sensors[i] < minv[i] + range/4) {
+				on &= ~(1 << i);
+				crossed |= 1 << i;
+				if (maxv[i] - top[i] < range >> CAL_SETTLE_SHIFT && bottom[i] - minv[i] < range >> CAL_SETTLE_SHIFT) {
+					settled |= 1 << i;
+				}
+			}
+		}
+		if (crossed & ((dir > 0) ? 0x01 : 0x10)) {
+			dir = -dir;
+			crossed = 0;
+			set_motors(dir*CAL_SPEED, -dir*CAL_SPEED);
+		}
 	}
-	stop_motors();
+	set_motors(0,0);
+	delay_ms(CAL_STOP_MS);
+
+	// back onto the line, slowly: towards it if a sensor sees it,
+	// otherwise back the way it came, and again if it turned on too far
+	freeze_calibration();
+	line_last = 0;
+	for (i=0; i<CAL_CENTRE_TRIES; i++) {
+		qtr_read(sensors);
+		if (ev_sensors(sensors, line_threshold)) {
+			position = line_position();
+			if (position < CAL_CENTRE_TOL && position > -CAL_CENTRE_TOL) { break; }
+			dir = (position > 0) ? 1 : -1;
+		} else {
+			dir = -moving;
+		}
+		moving = dir;
+		set_motors(dir*CAL_CENTRE_SPEED, -dir*CAL_CENTRE_SPEED);
+		for (; frames<CAL_MAX_FRAMES; frames++) {
+			delay_ms(CAL_PERIOD_MS);
+			qtr_read(sensors);
+			if (ev_sensors(sensors, line_threshold) && dir*line_position() < CAL_CENTRE_LEAD) { break; }
+		}
+		set_motors(0,0);
+		delay_ms(CAL_STOP_MS);
+	}
+	motor_stopped();
 }
 
 // Initializes the 3pi, displays a welcome message, calibrates, and
 // plays the initial music.
 void initialize() {
-	pololu_3pi_init(2000);
+	pololu_3pi_init(QTR_TIMEOUT);
+	qtr_init();
 	load_custom_characters(); // load the custom characters
-	print_from_program_space(robotName);
-	lcd_goto_xy(0,1);
-	print("Press B");
+	display_init();
+	display_print_from_program_space(robotName);
+	display_flush();
+}
+
+// With a calibration saved in EEPROM the robot is ready right away.
+// Holding A at power-on redoes the sensor calibration, holding C
+// also the speed test on the calibration strip; either way the
+// result is saved for the next boot. Returns 1 if the saved one was
+// used.
+unsigned char boot_calibration() {
+	unsigned char held = button_is_pressed(BUTTON_A | BUTTON_C);
+	display_goto_xy(0,1);
+	if (!held && calstore_load(minv, maxv)) {
+		freeze_calibration();
+		display_print("B to go");
+		display_flush();
+		return 1;
+	}
+	display_print("Press B");
+	display_flush();
+	idle_until_button_pressed(BUTTON_B);
+	qtr_read(sensors);
+	dance(); // sensor calibration
+	freeze_calibration();
+	if (held & BUTTON_C) { speed_calibrate(); }
+	calstore_save(minv, maxv);
+	return 0;
 }
 
 // Debugger Code
-void debug_1(long l) { lcd_goto_xy(0,0); print_long(l); }
-void debug_2(long l) { lcd_goto_xy(0,1); print_long(l); }
-void debug_a(long l_one, long l_two) { clear(); debug_1(l_one); debug_2(l_two); }
+void debug_1(long l) { display_goto_xy(0,0); display_print_long(l); }
+void debug_2(long l) { display_goto_xy(0,1); display_print_long(l); }
+void debug_a(long l_one, long l_two) { display_clear(); debug_1(l_one); debug_2(l_two); }
 
-// running the motors can cause the 3pi to go straight or make turns
-void run_motors_for_X_seconds(leftMotor,rightMotor,secondsToTurn) {
-	int i;
-	for (i=0;i<secondsToTurn;++i) { 
-		set_motors(leftMotor,rightMotor);
-		delay_ms(10);
+// Background tasks, run by the scheduler between control steps
+void check_buttons() {
+	unsigned char pressed = button_is_pressed(BUTTON_A | BUTTON_B | BUTTON_C);
+	unsigned char down = pressed & ~buttons_pressed;
+	if (down & BUTTON_B) {
+		play_from_program_space(beep_button_middle);
+		toggleRun();
+	}
+	if (down & BUTTON_A) {
+		play_from_program_space(beep_button_top);
+		tuning = tuning ? 0 : 1; // pressing again gives up
+	}
+#if PROFILE
+	if (down & BUTTON_C) {
+		play_from_program_space(beep_button_bottom);
+		prof_page = (prof_page < PROF_STAGES) ? prof_page+1 : 0;
+		if (prof_page == 1) { prof_sending = PROF_STAGES; }
+	}
+#endif
+	buttons_pressed = pressed;
+}
+
+#if PROFILE
+// Cycles in at most 4 characters
+void prof_print_cycles(unsigned long c) {
+	if (c < 10000) {
+		display_print_long(c);
+	} else {
+		display_print_long(c/1000);
+		display_print_character('k');
+	}
+}
+
+// A stage: its name and mean cycles, and the histogram as bars
+void prof_show(unsigned char stage) {
+	const prof_stage *p = &prof_stages[stage];
+	unsigned int most = 1;
+	unsigned char i;
+	display_clear();
+	for (i=0; i<3; i++) { display_print_character(pgm_read_byte(prof_names + 3*stage + i)); }
+	display_print_character(' ');
+	prof_print_cycles((unsigned long)prof_mean(stage)*PROF_CYCLES);
+	display_goto_xy(0,1);
+	for (i=0; i<PROF_BINS; i++) {
+		if (p->hist[i] > most) { most = p->hist[i]; }
+	}
+	for (i=0; i<PROF_BINS; i++) {
+		unsigned char c = (unsigned long)p->hist[i]*8/most;
+		if (p->hist[i] && !c) { c = 1; }
+		display_print_character(display_characters[c]);
 	}
+}
+
+// Sends the report a frame at a time, as the telemetry buffer allows
+void prof_send() {
+	if (prof_sending && telemetry_profile(PROF_STAGES - prof_sending)) { prof_sending--; }
+}
+#endif
+
+void show_debug() {
+#if PROFILE
+	if (prof_page) {
+		prof_show(prof_page-1);
+		return;
+	}
+#endif
+	display_clear();
+	if (tuning) {
+		display_print("TUNE ");
+		display_print_long(line_tune.cycles);
+		return;
+	}
+	display_print_long(marginalTheta);
+	display_goto_xy(1,1);
+	display_print_long(theta/1000);
+}
+
+// The LCD writes, timed for the profiler
+void display_task() {
+	PROF_BEGIN(PROF_LCD);
+	display_update();
+	PROF_END(PROF_LCD);
+}
+
+// Drives back to the origin along the shortest path. Keeps running on
+// the scheduler like the line following, integrating the pose every
+// step and steering toward where the origin is now: turns in place
+// while it is well off the nose, otherwise drives with a proportional
+// heading correction, slowing down over the last HOME_SLOW_DIST.
+// It gets to where the pose puts the origin, so with unequal wheels
+// it needs the speed test (speed_calibrate()) to have measured them.
+void go_home() {
+	int leftMotor, rightMotor, speed, turn;
+	unsigned int steps;
+	long error, dist;
+	unsigned long ax, ay;
+
+	for (steps=0; steps<HOME_MAX_STEPS; steps++) {
+		sched_wait();
+
+		// distance to go, within 7% (alpha max plus beta min, no square root)
+		ax = (xPos < 0) ? -xPos : xPos;
+		ay = (yPos < 0) ? -yPos : yPos;
+		dist = (ax > ay) ? ax + 3*ay/8 : ay + 3*ax/8;
+		if (dist < HOME_TOLERANCE) { break; }
+
+		// heading error to the origin, -180 to 180 degrees
+		error = (Atan2Milli(-xPos, -yPos) - theta) % 360000L;
+		if (error > 180000) { error -= 360000L; }
+		if (error < -180000) { error += 360000L; }
+		// the origin went by on the side or behind: stop rather than circle it
+		if (dist < HOME_SLOW_DIST/4 && (error > 90000 || error < -90000)) { break; }
+
+		if (error > HOME_PIVOT_ANGLE || error < -HOME_PIVOT_ANGLE) {
+			speed = 0;
+			turn = (error > 0) ? HOME_PIVOT_SPEED : -HOME_PIVOT_SPEED;
+		} else {
+			speed = (dist > HOME_SLOW_DIST) ? HOME_SPEED : HOME_MIN_SPEED + (int)(dist*(HOME_SPEED-HOME_MIN_SPEED)/HOME_SLOW_DIST);
+			turn = error/1500; // about a 0.2 s time constant
+		}
+		leftMotor = speed + turn;  // positive error is clockwise, to the right
+		rightMotor = speed - turn;
+
+		drive(leftMotor, rightMotor);
+
+		if (TELEMETRY) {
+			telemetry_step(sched_last_start, qtr_frame_ticks, motor_stamp, sched_ran, buttons_pressed, battery_read,
+			               sensors, 0, turn, motor_left, motor_right, xPos, yPos, theta);
+		}
+	}
+	sched_stop();
 	stop_motors();
 }
 
-void run_motor_for_X_seconds(motorSpeed,seconds) {
-	run_motors_for_X_seconds(motorSpeed,motorSpeed,seconds);
+// Line following, a control step at a time. Its state is kept out
+// here, and what a step takes in besides it goes out with the
+// step's telemetry frame, so that sim/replay can run a capture
+// through these very functions again.
+int follow_position = 0;        // line position relative to center
+int follow_offset = 0;
+int follow_speed;               // base speed of the step
+ev_state follow_events;
+
+// The background tasks and the controller, once the calibration and
+// the map are in place.
+void follow_start() {
+	sched_add_task(check_buttons, 20);
+	if (DEBUG) { sched_add_task(show_debug, 100); }
+	sched_add_task(display_task, 1);
+	sched_add_task(battery_update, 500);
+	sched_add_task(freeze_calibration, TRACK_REFRESH_MS);
+#if PROFILE
+	prof_reset();
+	if (TELEMETRY) { sched_add_task(prof_send, 20); }
+#endif
+	rls_init();
+	track_start();
+	follow_speed = rotation;
+	pid_set_gains(&line_pid, &pid_band_gains[pid_band(rotation)], MAX_MOTOR_SPEED);
+	pid_reset(&line_pid);
+	ev_reset(&follow_events);
+	pose_init(get_ticks());
+}
+
+// A control step, once the scheduler released it. Returns the line
+// event it saw.
+unsigned char follow_step() {
+	int leftMotor, rightMotor;
+	unsigned char event = EV_NONE;
+
+	PROF_BEGIN(PROF_STEP);
+	PROF_BEGIN(PROF_SENSORS);
+	qtr_take(sensors); // captured while the scheduler waited
+	PROF_END(PROF_SENSORS);
+	PROF_BEGIN(PROF_POSITION);
+	follow_position = line_position();
+	if (run == 1) { track_bounds(sensors); }
+	PROF_END(PROF_POSITION);
+
+	if (run == 1) {
+		// base speed: from the map, unless this is the lap that learns it
+		if (!map_learning && map.n) {
+			int band = pid_band(follow_speed);
+			follow_speed = map_profile(pose_dist >> POSE_FRAC);
+			if (pid_band(follow_speed) != band && !tuning) {
+				pid_set_gains(&line_pid, &pid_band_gains[pid_band(follow_speed)], MAX_MOTOR_SPEED);
+			}
+		}
+
+		// position = -1000 to 1000, or +-LINE_LOST
+		PROF_BEGIN(PROF_PID);
+		if (tuning == 1) {
+			pid_tune_start(&line_tune, TUNE_RELAY, TUNE_HYST);
+			tuning = 2;
+		}
+		if (tuning == 2) {
+			follow_offset = pid_tune_step(&line_tune, follow_position);
+			if (pid_tune_done(&line_tune)) {
+				if (pid_tune_gains(&line_tune, &pid_band_gains[pid_band(follow_speed)])) {
+					pid_tuned |= 1 << pid_band(follow_speed);
+					gains_tuned = 1;
+				}
+				pid_set_gains(&line_pid, &pid_band_gains[pid_band(follow_speed)], MAX_MOTOR_SPEED);
+				pid_reset(&line_pid);
+				play_from_program_space(thank_you_music);
+				tuning = 0;
+			}
+		} else {
+			follow_offset = pid_update(&line_pid, follow_position);
+		}
+		PROF_END(PROF_PID);
+
+		leftMotor = follow_speed + follow_offset;
+		rightMotor = follow_speed - follow_offset;
+
+		// truncation on positives.
+		leftMotor = (leftMotor > MAX_MOTOR_SPEED) ? MAX_MOTOR_SPEED : leftMotor;
+		rightMotor = (rightMotor > MAX_MOTOR_SPEED) ? MAX_MOTOR_SPEED : rightMotor;
+
+		// truncation on negatives for safety
+		leftMotor = (leftMotor < MIN_MOTOR_SPEED) ? MIN_MOTOR_SPEED : leftMotor;
+		rightMotor = (rightMotor < MIN_MOTOR_SPEED) ? MIN_MOTOR_SPEED : rightMotor;
+
+		PROF_BEGIN(PROF_DRIVE);
+		drive(leftMotor, rightMotor);
+		PROF_END(PROF_DRIVE);
+		PROF_BEGIN(PROF_MARKS);
+		event = ev_update(&follow_events, sensors, line_threshold, pose_dist >> POSE_FRAC, qtr_frame_ticks);
+		speed_marks(motor_left, motor_right, event);
+		map_learn(pose_dist >> POSE_FRAC, theta);
+		PROF_END(PROF_MARKS);
+	}
+
+	if (TELEMETRY) {
+		PROF_BEGIN(PROF_TELEMETRY);
+		telemetry_step(sched_last_start, qtr_frame_ticks, motor_stamp, sched_ran, buttons_pressed, battery_read,
+		               sensors, follow_position, follow_offset, motor_left, motor_right, xPos, yPos, theta);
+		PROF_END(PROF_TELEMETRY);
+	}
+	PROF_END(PROF_STEP);
+	return event;
 }
 
 // This is the main function, where the code starts. All C programs
 // must have a main() function defined somewhere.
 int main () {  
+  unsigned char learnt;
+  unsigned char event;
   
-  // line position relative to center
-  long position = 0;
-  long oldPosition = 0;
-  long derivative = 0;
-  int offset = 0;
-  int leftMotor = 0;
-  int rightMotor = 0;
-  long integral = 0;
-  int rotation = 35;
-  int i;
-  long oldTheta = 0;
-  long newTheta = 0;
-  long marginalTheta = 0;
-  long alpha = 0;
-  unsigned long prevTime = 0;
-  unsigned long deltaTime = 0;
-  
-  // set up the 3pi, and wait for B button to be pressed
+  // set up the 3pi, and calibrate unless that was saved
   initialize();
-  idle_until_button_pressed(BUTTON_B);
-  read_line_sensors(sensors,IR_EMITTERS_ON);
-  dance(); // sensor calibration
-  // speed_calibrate(30,60); // call this line to auto-calibrate the robot.
+  wheel_init();
+  battery_update();
+  // a fresh calibration learns the track again
+  if (!boot_calibration() || !map_load()) { map_learn_start(); }
+
+  sched_init(CONTROL_HZ);
+  sched_set_prefetch(qtr_start, SENSOR_LEAD_US);
+  if (TELEMETRY) { telemetry_init(); }
+  follow_start();
+  if (TELEMETRY) { telemetry_start(minv, maxv, line_last); }
   
   do {
-    if (button_is_pressed(BUTTON_B)) {
-      play_from_program_space(beep_button_middle);
-      toggleRun();
-      delay_ms(200);
-    }
-    
-		  oldPosition = position;	// compute line positon
-		  prevTime = millis();  //get the first time reading
-		  read_line_sensors(sensors, IR_EMITTERS_ON);
-		  update_bounds(sensors, minv, maxv);
-		  position = line_position();		//get the line position.
-		
-		if (run == 1) {	
-		  
-		  // position = -1000 to 1000
-		  derivative = position - oldPosition;
-		  integral = position + oldPosition;
-		  offset = 	position/20 + derivative/25 + integral/35;
-    
-      leftMotor = rotation + offset;
-      rightMotor = rotation - offset;
-
-			// truncation on positives.
-      leftMotor = (leftMotor > MAX_MOTOR_SPEED) ? MAX_MOTOR_SPEED : leftMotor;
-      rightMotor = (rightMotor > MAX_MOTOR_SPEED) ? MAX_MOTOR_SPEED : rightMotor;
-
-      // truncation on negatives for safety
-      leftMotor = (leftMotor < MIN_MOTOR_SPEED) ? MIN_MOTOR_SPEED : leftMotor;
-      rightMotor = (rightMotor < MIN_MOTOR_SPEED) ? MIN_MOTOR_SPEED : rightMotor;
-
-			//get the new marginal theta calculation.
-      marginalTheta = (long)( motor2angle(leftMotor, rightMotor) * deltaTime);
-			
-			// add it to the old theta calculation to get the new theta
-      newTheta = oldTheta + marginalTheta;
-			
-			// avg the two theta calculations to get the alpha angle.
-      alpha = (oldTheta + newTheta)/2;
-			
-			// alpha is 10^3 too big. as will be Sin & Cos. deltaTime is in terms of millisecs. 
-			// so, divide the resulting product by a million (1000*1000)
-			long speedCalc = deltaTime*motor2speed((leftMotor+rightMotor)/2);
-      xPos += (long)(Sin(alpha/1000)*speedCalc)/MILLION; 
-      yPos += (long)(Cos(alpha/1000)*speedCalc)/MILLION;
-
-      oldTheta = newTheta;
-
-      set_motors(leftMotor, rightMotor);
-    }
-    
-    // debug code
-		if (DEBUG) {
-			clear();
-			lcd_goto_xy(0,0);
-			print_long(marginalTheta);
-			lcd_goto_xy(1,1);
-			print_long(alpha/1000);
-		}
-    
-    delay_ms(40);	//delay the run loop to decrease the number of readings taken.
-    deltaTime = millis() - prevTime;	// new deltaTime
-    
-  } while(!off_track(0));
-
-  // Stop the motors, set the base speed to 40 and attempt to go home.
-  stop_motors();
-  rotation = 40;
+    sched_wait(); // start of the next control period
+    event = follow_step();
+  } while(event != EV_END);
+  learnt = map_learning;
+  map_learn_done(rotation);
 
-	// debugging.
+  // Leave the line and drive straight home, without stopping in between
+  // so the pose keeps being tracked.
+	// debugging. overruns and worst period error (us) of the control loop
 	if (DEBUG) {
-		clear();
-		lcd_goto_xy(0,0);
-		print("GO HOME");
-	}
-
-  int targetTheta = oldTheta/1000; // Reduce tracking-mode theta to scale
-	long oldXPos = xPos;					// save these values for later.
-	long oldYPos = yPos;
-	
-	// figure out which direction to turn in to make the robot point
-	// 180 degrees from its initial starting position. it is in one of four
-	// quadrants based upon the last theta calculation.
-  if (targetTheta > 0 && targetTheta <= 180) {
-    targetTheta = 180 - targetTheta;
-    leftMotor = rotation; //Clockwise
-    rightMotor = -rotation;
-  } else if (targetTheta < -180) {
-    targetTheta = targetTheta + 360;
-    leftMotor = rotation; //Clockwise
-    rightMotor = -rotation;
-  } else if (targetTheta > 180) {
-    targetTheta = 360 - targetTheta;
-    leftMotor = -rotation; //Counter-clockwise
-    rightMotor = rotation;
-  } else { //Thus tTheta is between -180 and 0
-    targetTheta = 180 + targetTheta;
-    leftMotor = -rotation; //Counter-clockwise
-    rightMotor = rotation;
-  }
- 
-  // turn the robot by this many centiseconds
-  long secondsToTurn = motor2angle(leftMotor,rightMotor); //Unit: Deg/sec
-  secondsToTurn = (110*targetTheta)/secondsToTurn; //Unit: Deg/(Deg/sec)
-  if (secondsToTurn < 0) secondsToTurn = -secondsToTurn;  //Flip if negative turn time
-
-	// debug code.
-	if (DEBUG) {
-		clear();
-		print_long(secondsToTurn);
-		lcd_goto_xy(1,1);
-		print_long(targetTheta);
+		display_clear();
+		display_print("GO HOME");
+		display_goto_xy(0,1);
+		display_print_long(sched_overruns);
+		display_print_character(' ');
+		display_print_long(sched_jitter_us);
+		display_flush();
 	}
+	go_home();
 
- 	// a loop that takes 10ms to process each centisecond. Ergo, we
- 	// turn the robot by this many milliseconds.
-	run_motors_for_X_seconds(leftMotor,rightMotor,secondsToTurn);
-  
-	prevTime = millis();	// reset the deltaTime tracking for this loop.
-	deltaTime = 0;			// resetting deltaTime
-	while (yPos > 0) { 
-		set_motors(rotation, rotation);
-		yPos -= motor2speed(rotation)*deltaTime/1000;		//deltaTime is in terms of seconds.
-		delay_ms(100);									// slow the loop down some.													
-		deltaTime = millis()-prevTime;		
-		prevTime = millis();						// reset the previous time value
-	}
-	stop_motors(); 
-
-	// done turning and traversing the yDistance.
-  // turn by 90 degrees to the right or left.
-  targetTheta = 90;
-
-  // turn robot to the proper angle based upon where it began.
-  // this is determined by what quadrant it was in when it detected the 
-  // end of the line. the values of the x and y coordinates tell us which
-  // way to turn to get back to the origin after hitting the x-axis 
-  if ((oldXPos > 0 && oldYPos > 0) || (oldXPos < 0 && oldYPos < 0)) {
-   	leftMotor = rotation;
-   	rightMotor = -rotation;		// q1 && q3
-   } else {
-  	leftMotor = -rotation;		// q2 & q4
-  	rightMotor = rotation;
-  }
-
-	// re-calculate the time to rotate again, this time to point to the origin.
-  secondsToTurn = motor2angle(leftMotor,rightMotor); //Unit: Deg/sec
-  secondsToTurn = (110*targetTheta)/secondsToTurn; //Unit: Deg/(Deg/sec)
-  
-  if (secondsToTurn < 0) secondsToTurn = -secondsToTurn;  //Flip if negative turn time
+	// keep what the speed marks taught the motor model, and new gains
+	if (rls_updates || gains_tuned) { calstore_save(minv, maxv); }
+	// and the map, if this lap learnt it
+	if (learnt && map.n) { map_save(); }
 
-	// debugging.
-	if (DEBUG) {
-		clear();
-		print_long(secondsToTurn);
-		lcd_goto_xy(1,1);
-		print_long(targetTheta);
-	}
-
-  // do the rotation. same code as above for the yPos.
-	run_motors_for_X_seconds(leftMotor,rightMotor,secondsToTurn);
-
-	if (xPos < 0) xPos = -xPos;		// flip x if it's negative.	
-	  
-	prevTime = millis();	// reset the deltaTime tracking for this loop.
-	deltaTime = 0;			// resetting deltaTime
-	while (xPos > 0) { 	// this time, decrement X till we're done.
-		set_motors(rotation, rotation);
-		xPos -= motor2speed(rotation)*deltaTime/1000;	
-		delay_ms(100);		// delay to slow the loop down.
-		deltaTime = millis()-prevTime;
-		prevTime = millis();
-	}
-	stop_motors(); 
-	
 	// DONE! YAYYYYYYYYYYY! :)
   return 0;
 }
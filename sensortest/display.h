@@ -0,0 +1,112 @@
+#include <avr/pgmspace.h>
+
+////////////////////////////////////////////////////////////////
+// Incremental LCD output.
+// Everything is written to a 2x8 shadow of the screen in RAM, which
+// costs next to nothing. display_update() compares the shadow with
+// what the LCD already shows and sends at most a few changed
+// characters, so it can run as a background task without the
+// HD44780 clear (~2 ms) or a full redraw ever blocking the loop.
+// Outside of the scheduler, display_flush() sends all the changes.
+
+#define DISPLAY_COLS 8
+#define DISPLAY_ROWS 2
+#define DISPLAY_CHARS_PER_UPDATE 3
+
+char display_want[DISPLAY_ROWS][DISPLAY_COLS];  // what we want on screen
+char display_shown[DISPLAY_ROWS][DISPLAY_COLS]; // what is on screen
+unsigned char display_x, display_y;             // shadow cursor
+unsigned char display_lcd_x, display_lcd_y;     // LCD cursor, after its auto-increment
+unsigned char display_scan;                     // where display_update() looks first
+
+// Clears the LCD for real, once, so the shadow starts in sync.
+void display_init() {
+	unsigned char x, y;
+	clear();
+	for (y=0; y<DISPLAY_ROWS; y++) {
+		for (x=0; x<DISPLAY_COLS; x++) {
+			display_want[y][x] = ' ';
+			display_shown[y][x] = ' ';
+		}
+	}
+	display_x = display_y = 0;
+	display_lcd_x = display_lcd_y = 0;
+	display_scan = 0;
+}
+
+void display_clear() {
+	unsigned char x, y;
+	for (y=0; y<DISPLAY_ROWS; y++) {
+		for (x=0; x<DISPLAY_COLS; x++) { display_want[y][x] = ' '; }
+	}
+	display_x = display_y = 0;
+}
+
+void display_goto_xy(unsigned char x, unsigned char y) {
+	display_x = x;
+	display_y = y;
+}
+
+// Characters past the end of a row are dropped, as they are invisible
+// on the 8 character LCD anyway.
+void display_print_character(char c) {
+	if (display_x < DISPLAY_COLS && display_y < DISPLAY_ROWS) {
+		display_want[display_y][display_x] = c;
+	}
+	display_x++;
+}
+
+void display_print(const char *s) {
+	while (*s) { display_print_character(*s++); }
+}
+
+void display_print_from_program_space(const char *s) {
+	char c;
+	while ((c = pgm_read_byte(s++))) { display_print_character(c); }
+}
+
+void display_print_long(long value) {
+	char digits[10];
+	unsigned char n = 0;
+	unsigned long v = (value < 0) ? -value : value;
+	if (value < 0) { display_print_character('-'); }
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	while (n) { display_print_character(digits[--n]); }
+}
+
+// Sends up to DISPLAY_CHARS_PER_UPDATE changed characters to the LCD.
+// The scan resumes where it left off, and neighbouring changes go out
+// without moving the LCD cursor.
+void display_update() {
+	unsigned char i, sent = 0;
+	for (i=0; i<DISPLAY_ROWS*DISPLAY_COLS && sent<DISPLAY_CHARS_PER_UPDATE; i++) {
+		unsigned char x = display_scan % DISPLAY_COLS;
+		unsigned char y = display_scan / DISPLAY_COLS;
+		display_scan = (display_scan+1) % (DISPLAY_ROWS*DISPLAY_COLS);
+		if (display_want[y][x] == display_shown[y][x]) { continue; }
+		if (x != display_lcd_x || y != display_lcd_y) { lcd_goto_xy(x,y); }
+		print_character(display_want[y][x]);
+		display_shown[y][x] = display_want[y][x];
+		display_lcd_x = x+1;
+		display_lcd_y = y;
+		sent++;
+	}
+}
+
+// Returns 1 while the LCD doesn't show the shadow yet.
+unsigned char display_pending() {
+	unsigned char x, y;
+	for (y=0; y<DISPLAY_ROWS; y++) {
+		for (x=0; x<DISPLAY_COLS; x++) {
+			if (display_want[y][x] != display_shown[y][x]) { return 1; }
+		}
+	}
+	return 0;
+}
+
+void display_flush() {
+	while (display_pending()) { display_update(); }
+}
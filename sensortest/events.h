@@ -0,0 +1,135 @@
+////////////////////////////////////////////////////////////////
+// Line events.
+// Each sensor frame is sorted into what it shows under the robot:
+// the line, nothing, more black than one line can cover on either
+// side (a branch) or right across (a cross). A new kind of frame only
+// takes over once every frame since it first showed up has agreed,
+// over at least EV_DEBOUNCE of travel. It is distance rather than a
+// count of frames, so the same marks are told apart at any speed, and
+// a noisy frame, or the line brushing an outer sensor on a curve,
+// doesn't make an event. The caller gives the distance driven with
+// each frame (pose_dist), the detector takes no time of its own.
+// What comes out, once per event:
+//  EV_MARK   the line broke off: the leading edge of a gap, of the
+//            speed calibration marks or of the end of the line
+//  EV_GAP    and came back within EV_END_DIST; ev_state.length is how
+//            long it was missing
+//  EV_END    or has stayed away for EV_END_DIST: the end of the line.
+//            If it was last seen off to a side, clear of the middle
+//            sensor, it is the robot that left the line on a curve
+//            and it is given EV_LOST_DIST to find it back.
+//  EV_LEFT   a branch off to the left (sensors 0-3 on black, 4 not)
+//  EV_RIGHT  and to the right
+//  EV_CROSS  all five on black, a cross mark or a crossing line
+// ev_state.dist and .ticks say where and when the frames of the last
+// event started. Only comparisons and subtractions, no divides.
+
+#define EV_DEBOUNCE 30          // 0.1 mm a new kind of frame has to last
+#define EV_END_DIST 300         // 0.1 mm without the line that is the end of it
+#define EV_LOST_DIST 1500       // the same after losing it off a side
+
+// events
+#define EV_NONE 0
+#define EV_MARK 1
+#define EV_GAP 2
+#define EV_END 3
+#define EV_LEFT 4
+#define EV_RIGHT 5
+#define EV_CROSS 6
+
+// kinds of frame
+#define EV_F_LINE 0
+#define EV_F_NONE 1
+#define EV_F_LEFT 2
+#define EV_F_RIGHT 3
+#define EV_F_CROSS 4
+
+typedef struct {
+	unsigned char state;        // the kind of frame last taken over, EV_F_*
+	unsigned char frame;        // kind of the frames seen since run_dist
+	long run_dist;              // where they started
+	unsigned long run_ticks;
+	long lost;                  // where the line broke off, while state is EV_F_NONE
+	unsigned char seen;         // sensors on black in the last frame that had any
+	long give_up;               // EV_END_DIST or EV_LOST_DIST, for this time
+	unsigned char ended;        // EV_END has been given for it
+	long dist;                  // start of the last event
+	unsigned long ticks;
+	long length;                // of the last gap
+} ev_state;
+
+// On the line, with nothing seen yet.
+void ev_reset(ev_state *e) {
+	e->state = EV_F_LINE;
+	e->frame = EV_F_LINE;
+	e->run_dist = 0;
+	e->run_ticks = 0;
+	e->ended = 0;
+	e->seen = 0x04;
+}
+
+// Sensors at or over threshold, bit i for sensor i.
+unsigned char ev_sensors(const unsigned int *s, const unsigned int *threshold) {
+	unsigned char i, on = 0;
+	for (i=0; i<5; i++) {
+		if (s[i] >= threshold[i]) { on |= 1 << i; }
+	}
+	return on;
+}
+
+// What a frame with these sensors on shows.
+unsigned char ev_frame(unsigned char on) {
+	if (on == 0) { return EV_F_NONE; }
+	if (on == 0x1f) { return EV_F_CROSS; }
+	if (on == 0x0f) { return EV_F_LEFT; }   // a line 19 mm wide covers at most three
+	if (on == 0x1e) { return EV_F_RIGHT; }
+	return EV_F_LINE;
+}
+
+// Takes the next frame, driven up to dist (0.1 mm) and stamped with
+// ticks, and returns the event it completes, or EV_NONE.
+unsigned char ev_update(ev_state *e, const unsigned int *s, const unsigned int *threshold, long dist, unsigned long ticks) {
+	unsigned char on = ev_sensors(s, threshold);
+	unsigned char f = ev_frame(on);
+	if (on) { e->seen = on; }
+	if (f != e->frame) {
+		e->frame = f;
+		e->run_dist = dist;
+		e->run_ticks = ticks;
+	}
+
+	if (f == e->state || dist - e->run_dist < EV_DEBOUNCE) {
+		// the end, unless the line is already coming back
+		if (f == EV_F_NONE && e->state == f && !e->ended && dist - e->lost >= e->give_up) {
+			e->ended = 1;
+			return EV_END;
+		}
+		return EV_NONE;
+	}
+
+	// the frames since run_dist take over
+	if (f == EV_F_NONE) {
+		e->state = f;
+		e->lost = e->run_dist;
+		e->give_up = (e->seen & 0x04) ? EV_END_DIST : EV_LOST_DIST;
+		e->ended = 0;
+		e->dist = e->run_dist;
+		e->ticks = e->run_ticks;
+		return EV_MARK;
+	}
+	if (e->state == EV_F_NONE) {
+		// back on the line; a branch or cross right after the gap is
+		// given on the next frame
+		e->state = EV_F_LINE;
+		if (e->ended) { return EV_NONE; }
+		e->length = e->run_dist - e->lost;
+		e->dist = e->run_dist;
+		e->ticks = e->run_ticks;
+		return EV_GAP;
+	}
+	e->state = f;
+	if (f == EV_F_LINE) { return EV_NONE; }
+	e->dist = e->run_dist;
+	e->ticks = e->run_ticks;
+	return (f == EV_F_LEFT) ? EV_LEFT : (f == EV_F_RIGHT) ? EV_RIGHT : EV_CROSS;
+}
@@ -0,0 +1,45 @@
+////////////////////////////////////////////////////////////////
+// Motor output stage.
+// Commands go out through a slew limit: each wheel's command moves by
+// at most MOTOR_SLEW per millisecond since the last one was sent, the
+// two wheels independently. A kick of the controller or the start of a
+// pivot becomes a ramp the wheels can follow rather than a step that
+// breaks their grip, and the pose (pose.h) is given what was actually
+// sent, not what was asked for. Time between commands counts up to
+// MOTOR_MAX_GAP, so the first command after a stop ramps up too.
+// The simulator's wheels never slip, so there a limit only costs
+// response: MOTOR_SLEW is as low as it goes there without slowing a
+// lap at base speed 200. Lower it for a slippery floor.
+
+#ifndef MOTOR_SLEW
+#define MOTOR_SLEW 32           // command units per ms
+#endif
+#define MOTOR_MAX_GAP 12500UL   // ticks (5 ms, a control period)
+
+int motor_left, motor_right;    // commands last sent
+unsigned long motor_stamp;      // get_ticks() they were sent at
+
+// One wheel's command, at most step away from the last.
+int motor_limit(int last, int v, int step) {
+	if (v > last + step) { return last + step; }
+	if (v < last - step) { return last - step; }
+	return v;
+}
+
+// Sends the commands at ticks, as far as the slew limit lets them go.
+void motor_output(int left, int right, unsigned long ticks) {
+	unsigned long dt = ticks - motor_stamp;
+	int step;
+	if (dt > MOTOR_MAX_GAP) { dt = MOTOR_MAX_GAP; }
+	// dt/2500 ms, as (dt >> 6)*105/2^12
+	step = (int)(((dt >> 6)*(105UL*MOTOR_SLEW)) >> 12);
+	motor_stamp = ticks;
+	motor_left = motor_limit(motor_left, left, step);
+	motor_right = motor_limit(motor_right, right, step);
+	set_motors(motor_left, motor_right);
+}
+
+// The motors were stopped some other way.
+void motor_stopped() {
+	motor_left = motor_right = 0;
+}
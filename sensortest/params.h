@@ -0,0 +1,15 @@
+////////////////////////////////////////////////////////////////
+// Tuned constants for the track at hand.
+// sim/sweep searches these against the simulator and writes a file
+// like this one; copy it over params.h and reflash.
+
+#define BASE_SPEED 60 // motor command when following a straight line
+#define LINE_THRESHOLD 25 // off the line below this % of the sensor range
+
+// PID gains for the base speed bands in pid.h: {kp, ki, kd}
+#define PID_BAND_GAINS { \
+	{102, 408, 408}, \
+	{54, 130, 2000}, \
+	{90, 240, 540}, \
+	{90, 240, 700}, \
+}
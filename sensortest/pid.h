@@ -0,0 +1,168 @@
+////////////////////////////////////////////////////////////////
+// Fixed-point PID for the line follower.
+// The error is the line position (-1000 to 1000) and the output a
+// motor offset. The loop runs at a fixed rate, so the integral and
+// derivative are per control step and the gains hold for one
+// CONTROL_HZ only. kp and kd are Q10 (1024 is one motor unit per
+// position unit), ki is Q16 because it is much smaller per step.
+//  - the integral only accumulates while the output isn't pushing
+//    against its limit, and is bounded so ki*integral alone can't
+//    saturate the output (anti-windup)
+//  - the derivative is taken on the measurement and low-pass
+//    filtered, as the sensors step by whole levels
+// Gains are kept per base speed band, and can be measured on the
+// robot with a relay experiment (pid_tune_*).
+
+#define PID_KP_SHIFT 10
+#define PID_KI_SHIFT 16
+#define PID_D_SHIFT 2           // derivative filter, each new step weighs 1/4
+#define PID_D_FRAC 4            // filtered derivative carries 4 fraction bits
+
+typedef struct {
+	int kp;                     // Q10
+	int ki;                     // Q16, per step
+	int kd;                     // Q10, per step
+} pid_gains;
+
+typedef struct {
+	pid_gains g;
+	int out_max;
+	long integral;              // sum of the errors
+	long i_limit;               // bound on |integral|
+	long d;                     // filtered change of the error per step, Q4
+	int last;
+	unsigned char started;
+} pid_state;
+
+void pid_reset(pid_state *p) {
+	p->integral = 0;
+	p->d = 0;
+	p->started = 0;
+}
+
+void pid_set_gains(pid_state *p, const pid_gains *g, int out_max) {
+	p->g = *g;
+	p->out_max = out_max;
+	p->i_limit = (g->ki > 0) ? ((long)out_max << PID_KI_SHIFT)/g->ki : 0;
+	if (p->integral > p->i_limit) { p->integral = p->i_limit; }
+	if (p->integral < -p->i_limit) { p->integral = -p->i_limit; }
+}
+
+// Returns the output for this step's error.
+int pid_update(pid_state *p, int error) {
+	long out;
+	if (!p->started) {
+		p->last = error;
+		p->started = 1;
+	}
+	p->d += (((long)(error - p->last) << PID_D_FRAC) - p->d) >> PID_D_SHIFT;
+	p->last = error;
+
+	out = ((long)p->g.kp*error + (((long)p->g.kd*p->d) >> PID_D_FRAC)) >> PID_KP_SHIFT;
+	out += ((long)p->g.ki*p->integral) >> PID_KI_SHIFT;
+
+	// integrate unless that would push further into the limit
+	if ((out < p->out_max || error < 0) && (out > -p->out_max || error > 0)) {
+		p->integral += error;
+		if (p->integral > p->i_limit) { p->integral = p->i_limit; }
+		if (p->integral < -p->i_limit) { p->integral = -p->i_limit; }
+	}
+
+	if (out > p->out_max) { return p->out_max; }
+	if (out < -p->out_max) { return -p->out_max; }
+	return (int)out;
+}
+
+////////////////////////////////////////////////////////////////
+// Gain schedule: one set of gains per band of base motor speeds.
+// A base speed uses the gains of the fastest band it reaches.
+// The gains are PID_BAND_GAINS from params.h, which sim/sweep writes;
+// the relay tuning below replaces a band's on the robot. The original
+// controller, position/20 + derivative/25 + integral/35 with the
+// "integral" over two steps, was about {110, 0, 12}.
+#define PID_BANDS 4
+#ifndef PID_BAND_GAINS
+#error "PID_BAND_GAINS comes from params.h, include it before pid.h"
+#endif
+const int pid_band_speed[PID_BANDS] = {35, 60, 90, 120};
+pid_gains pid_band_gains[PID_BANDS] = PID_BAND_GAINS;
+unsigned char pid_tuned;        // bands the relay tuned, bit b for band b, see calstore.h
+
+unsigned char pid_band(int speed) {
+	unsigned char b = PID_BANDS-1;
+	while (b > 0 && speed < pid_band_speed[b]) { b--; }
+	return b;
+}
+
+////////////////////////////////////////////////////////////////
+// Relay auto-tuning (Astrom-Hagglund).
+// The PID is replaced by a relay that steers +-h depending on which
+// side of the line the robot is, with a little hysteresis against
+// sensor noise. The robot settles into a weaving limit cycle whose
+// period Tu and amplitude a give the ultimate gain Ku = 4h/(pi*a),
+// from which the gains follow with the Ziegler-Nichols rule:
+// Kp = 0.6 Ku, Ti = Tu/2, Td = Tu/8. The first cycle is skipped
+// while the weave builds up.
+#define PID_TUNE_CYCLES 5       // cycles averaged
+
+typedef struct {
+	int h;                      // relay output, motor units
+	int hyst;                   // hysteresis, position units
+	signed char side;
+	int hi, lo;                 // extremes of the current cycle
+	unsigned int steps;         // since the current cycle started
+	unsigned char cycles;       // cycles seen, the first one is not used
+	long amp_sum;               // peak to peak, summed over the cycles
+	unsigned long period_sum;   // steps, summed over the cycles
+} pid_tune;
+
+void pid_tune_start(pid_tune *t, int h, int hyst) {
+	t->h = h;
+	t->hyst = hyst;
+	t->side = 1;                // kick off the weave
+	t->hi = t->lo = 0;
+	t->steps = 0;
+	t->cycles = 0;
+	t->amp_sum = 0;
+	t->period_sum = 0;
+}
+
+unsigned char pid_tune_done(const pid_tune *t) {
+	return t->cycles > PID_TUNE_CYCLES;
+}
+
+// Returns the relay output for this step's error.
+int pid_tune_step(pid_tune *t, int error) {
+	t->steps++;
+	if (error > t->hi) { t->hi = error; }
+	if (error < t->lo) { t->lo = error; }
+	if (error > t->hyst && t->side <= 0) {
+		// a new cycle starts each time the relay flips to +h
+		if (t->cycles > 0 && t->side < 0) {
+			t->amp_sum += t->hi - t->lo;
+			t->period_sum += t->steps;
+		}
+		if (t->side < 0) { t->cycles++; }
+		t->side = 1;
+		t->steps = 0;
+		t->hi = t->lo = error;
+	} else if (error < -t->hyst && t->side >= 0) {
+		t->side = -1;
+	}
+	return t->side*t->h;
+}
+
+// Gains from the measured limit cycle, returns 0 if there was no
+// usable oscillation.
+unsigned char pid_tune_gains(const pid_tune *t, pid_gains *g) {
+	long a, ku, tu;
+	if (!pid_tune_done(t)) { return 0; }
+	a = t->amp_sum/(2*PID_TUNE_CYCLES);         // amplitude
+	tu = t->period_sum/PID_TUNE_CYCLES;          // steps
+	if (a <= 0 || tu < 4) { return 0; }
+	ku = (long)t->h*1304/a;                      // 4/pi in Q10 is 1304
+	g->kp = ku*3/5;
+	g->ki = (((long)g->kp << (PID_KI_SHIFT-PID_KP_SHIFT))*2)/tu;
+	g->kd = (long)g->kp*tu/8;
+	return 1;
+}
@@ -0,0 +1,141 @@
+#include <avr/pgmspace.h>
+
+////////////////////////////////////////////////////////////////
+// Pose estimate (dead reckoning) from the motor commands.
+// Every command is integrated over exactly the time it was in
+// effect, from the get_ticks() stamps taken when it was given, so
+// the result doesn't depend on the loop rate or on late steps.
+// Nothing is truncated away between updates:
+//  - the position is kept in 0.1 mm with 8 fraction bits
+//  - the heading is a 32-bit binary angle (2^32 to a turn), which
+//    also wraps around by itself
+// Each interval is a constant curvature arc: the robot moves along
+// the chord, 2R sin(a/2) = d (1 - a^2/24 ...) long, in the direction
+// of the heading halfway through the turn a.
+// Wheel speeds come from the tables of wheel_speed(), the turn rate
+// from their difference over robot_width.
+// The wheels don't take the speed of a new command at once: each one
+// is modelled as a first order lag, closing 1 - e^(-dt/tau) of the gap
+// to its table speed over dt (as x - x^2/2 + x^3/6, x = dt/tau), and
+// the arc of an interval is driven at the mean of the speeds it
+// started and ended with. Without it a step in the command counts
+// tau's worth of travel that never happened. tau is per wheel,
+// wheel_tau_ms[] in calibration.h.
+
+#define POSE_FRAC 8             // fraction bits of pose_x and pose_y
+#define POSE_TICK_SHIFT 2       // integrates in 4 tick (1.6 us) units
+#define POSE_LAG_STEP 6250      // at most 10 ms at a time, for the wheel model
+
+long pose_x, pose_y;            // 0.1 mm << POSE_FRAC, x to the right, y ahead at boot
+unsigned long pose_heading;     // clockwise from +y
+long pose_dist;                 // distance driven, 0.1 mm << POSE_FRAC
+unsigned long pose_stamp;       // get_ticks() the pose is integrated up to
+int pose_left, pose_right;      // commands in effect since then
+long pose_vl, pose_vr;          // modelled wheel speeds, 0.1 mm/s Q12, so they settle
+unsigned int pose_lag_k[2];     // 2^28/tau of each wheel, tau in 4 tick units
+long pose_turn_scale;           // 2^32*1.6us/(2 pi robot_width), Q15
+
+// Starts at the origin facing +y, with the motors stopped.
+void pose_init(unsigned long ticks) {
+	pose_x = pose_y = 0;
+	pose_heading = 0;
+	pose_dist = 0;
+	pose_stamp = ticks;
+	pose_left = pose_right = 0;
+	pose_vl = pose_vr = 0;
+	pose_lag_k[WHEEL_LEFT] = (unsigned int)((1UL << 28)/((unsigned long)wheel_tau_ms[WHEEL_LEFT]*(2500 >> POSE_TICK_SHIFT)));
+	pose_lag_k[WHEEL_RIGHT] = (unsigned int)((1UL << 28)/((unsigned long)wheel_tau_ms[WHEEL_RIGHT]*(2500 >> POSE_TICK_SHIFT)));
+	pose_turn_scale = ROBOT_TURN_SCALE(robot_width);
+}
+
+// a*b >> shift, rounded, for an a of up to 30 bits and a b of up to
+// 16, without overflowing 32 bits
+unsigned long pose_mul_shift(unsigned long a, unsigned int b, unsigned char shift) {
+	unsigned long hi = (a >> 16)*b;     // weighs 2^16
+	unsigned long lo = (a & 0xffff)*b;
+	if (shift > 16) { return (hi + (lo >> 16) + (1UL << (shift-17))) >> (shift-16); }
+	return (hi << (16-shift)) + ((lo + (1UL << (shift-1))) >> shift);
+}
+
+// Moves a modelled wheel speed towards its command over dt.
+long pose_lag(long v, int command_speed, unsigned int dt, unsigned char wheel) {
+	unsigned long x = ((unsigned long)dt*pose_lag_k[wheel]) >> 12;  // dt/tau, Q16
+	unsigned long x2 = (x*x) >> 16;
+	long d = ((long)command_speed << 12) - v;
+	unsigned int k = (unsigned int)(x - x2/2 + ((x2*x) >> 16)/6);  // 1 - e^-x, Q16
+	if (d < 0) { return v - (long)pose_mul_shift(-d, k, 16); }
+	return v + (long)pose_mul_shift(d, k, 16);
+}
+
+void pose_step(unsigned int dt) {
+	long vl0 = pose_vl, vr0 = pose_vr;
+	long vl, vr, v, w;
+	unsigned long a;
+	unsigned int mid;
+	long turn, dist, chord;
+
+	pose_vl = pose_lag(pose_vl, wheel_speed(WHEEL_LEFT, pose_left), dt, WHEEL_LEFT);
+	pose_vr = pose_lag(pose_vr, wheel_speed(WHEEL_RIGHT, pose_right), dt, WHEEL_RIGHT);
+	vl = (vl0 + pose_vl + 4096) >> 13;  // mean over dt, 0.1 mm/s
+	vr = (vr0 + pose_vr + 4096) >> 13;
+	v = vl + vr;                        // twice the speed
+	w = vl - vr;
+
+	// heading change, binary angle: (vl-vr)*dt/width*2^32/(2 pi)
+	a = (unsigned long)((w < 0) ? -w : w)*dt;
+	turn = (long)pose_mul_shift(a, (unsigned int)pose_turn_scale, 15);
+	if (w < 0) { turn = -turn; }
+
+	// distance, 0.1 mm << POSE_FRAC: v/2*dt*1.6us*256 is v*dt*13744/2^26
+	a = (unsigned long)((v < 0) ? -v : v)*dt;
+	dist = (long)pose_mul_shift(a, 13744, 26);
+	if (v < 0) { dist = -dist; }
+
+	// chord of the arc: d*(1 - a^2/24), with a in radians;
+	// a^2/24 in Q14 is t^2*1685/2^28 for a 16-bit binary angle t
+	chord = dist;
+	{
+		long t = turn >> 16;
+		if (t < 0) { t = -t; }
+		if (t > 2048) { t = 2048; }     // 11 degrees per step is plenty
+		chord -= (dist*((((t*t) >> 4)*1685) >> 24)) >> 14;
+	}
+
+	mid = (unsigned int)((pose_heading + turn/2) >> 16);
+	pose_x += (chord*sin_bam(mid) + 8192) >> 14;
+	pose_y += (chord*cos_bam(mid) + 8192) >> 14;
+	pose_dist += (dist < 0) ? -dist : dist;
+	pose_heading = (pose_heading + turn) & 0xffffffffUL; // a no-op where long is 32 bits
+}
+
+// Integrates the commands in effect up to ticks. Stopped, with both
+// wheels at rest (under 0.1 mm/s), there is nothing to integrate, so a
+// wait such as the one for button B before a run is skipped rather
+// than stepped through POSE_LAG_STEP at a time on the first command.
+void pose_advance(unsigned long ticks) {
+	unsigned long dt = (ticks - pose_stamp) >> POSE_TICK_SHIFT;
+	pose_stamp += dt << POSE_TICK_SHIFT; // the leftover ticks count next time
+	if (!pose_left && !pose_right && pose_vl < 4096 && pose_vl > -4096 && pose_vr < 4096 && pose_vr > -4096) {
+		pose_vl = pose_vr = 0;
+		return;
+	}
+	while (dt > POSE_LAG_STEP) {
+		pose_step(POSE_LAG_STEP);
+		dt -= POSE_LAG_STEP;
+	}
+	if (dt) { pose_step((unsigned int)dt); }
+}
+
+// New motor commands, in effect from the last pose_advance().
+void pose_command(int left, int right) {
+	pose_left = left;
+	pose_right = right;
+}
+
+// heading in 1/1000 of a degree, -180000 to 180000
+long pose_heading_mdeg() {
+	// 360000/65536 is exactly 5625/1024
+	long h = (long)(pose_heading >> 16);
+	if (h >= 32768) { h -= 65536; }
+	return (h*5625) >> 10;
+}
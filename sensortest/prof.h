@@ -0,0 +1,99 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+////////////////////////////////////////////////////////////////
+// Control loop profiler.
+// PROF_BEGIN(stage) and PROF_END(stage) around a piece of the loop
+// record how long it took, in CPU cycles, as a minimum, a mean, a
+// maximum and a histogram with one bin per power of two. The clock is
+// timer 0, which the motor PWM keeps running at 20 MHz/8, extended
+// by the overflows the scheduler counts (sched_ovf): 8 cycle steps,
+// and a stage may take up to 26 ms. Reading it costs about 30 cycles.
+// (Timer 1 would count single cycles, but the buzzer reprograms it.)
+// Build with -DPROFILE=0 and the macros and all of the data go away.
+
+#ifndef PROFILE
+#define PROFILE 1
+#endif
+
+// stages, see prof_names in dead.c and sim/teledecode.c
+#define PROF_STEP 0        // the whole control step
+#define PROF_SENSORS 1     // taking the sensor frame
+#define PROF_POSITION 2    // line_position()
+#define PROF_PID 3         // controller
+#define PROF_DRIVE 4       // pose update and set_motors()
+#define PROF_MARKS 5       // line events and speed_marks()
+#define PROF_TELEMETRY 6   // queueing the telemetry frame
+#define PROF_LCD 7         // display_update(), in the background
+#define PROF_STAGES 8
+
+#define PROF_BINS 8        // < 512 cycles, < 1024, ... < 32768, more
+#define PROF_CYCLES 8      // cycles per prof_now() count
+
+#if PROFILE
+
+typedef struct {
+	unsigned int min, max;          // prof_now() counts
+	unsigned long sum;
+	unsigned int n;                 // stops counting at 65535, and so does sum
+	unsigned int hist[PROF_BINS];
+} prof_stage;
+
+prof_stage prof_stages[PROF_STAGES];
+unsigned int prof_begin[PROF_STAGES];
+
+#define PROF_BEGIN(stage) (prof_begin[stage] = prof_now())
+#define PROF_END(stage) prof_record(stage, prof_now() - prof_begin[stage])
+
+void prof_reset() {
+	unsigned char s, b;
+	for (s=0; s<PROF_STAGES; s++) {
+		prof_stages[s].min = 0xffff;
+		prof_stages[s].max = 0;
+		prof_stages[s].sum = 0;
+		prof_stages[s].n = 0;
+		for (b=0; b<PROF_BINS; b++) { prof_stages[s].hist[b] = 0; }
+	}
+}
+
+// Timer 0 as a 16-bit count of 8 cycles, valid once sched_init() ran.
+unsigned int prof_now() {
+	unsigned char sreg = SREG, lo, hi;
+	cli();
+	lo = TCNT0;
+	hi = sched_ovf;
+	// an overflow that the interrupt hasn't counted yet
+	if ((TIFR0 & (1 << TOV0)) && lo < 128) { hi++; }
+	SREG = sreg;
+	return ((unsigned int)hi << 8) | lo;
+}
+
+void prof_record(unsigned char stage, unsigned int counts) {
+	prof_stage *p = &prof_stages[stage];
+	unsigned char b = 0;
+	unsigned int c = counts >> 6;    // 512 cycles
+	if (counts < p->min) { p->min = counts; }
+	if (counts > p->max) { p->max = counts; }
+	if (p->n != 0xffff) {
+		p->n++;
+		p->sum += counts;
+	}
+	while (c && b < PROF_BINS-1) {
+		c >>= 1;
+		b++;
+	}
+	if (p->hist[b] != 0xffff) { p->hist[b]++; }
+}
+
+// mean, in prof_now() counts
+unsigned int prof_mean(unsigned char stage) {
+	const prof_stage *p = &prof_stages[stage];
+	return p->n ? (unsigned int)(p->sum/p->n) : 0;
+}
+
+#else
+
+#define PROF_BEGIN(stage) do {} while (0)
+#define PROF_END(stage) do {} while (0)
+
+#endif
@@ -0,0 +1,127 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+////////////////////////////////////////////////////////////////
+// Interrupt-driven line sensor reading.
+// The QTR-RC sensors on PC0-PC4 are read by charging their
+// capacitors and timing how long each takes to discharge, up to
+// ~0.8 ms. read_line_sensors() busy-waits all that time. Here the
+// discharge is timed by the pin change interrupt instead: qtr_start()
+// charges the sensors and returns, the interrupt stamps each pin as
+// it falls, and the frame is complete when the last one has fallen
+// or the timeout has passed. Frames are double-buffered, so the one
+// being captured never overwrites the one being used.
+// The emitters (PC5) are left on between frames.
+
+#define QTR_SENSORS 5
+#define QTR_PINS 0x1f            // PC0-PC4, PCINT8-PCINT12
+#define QTR_EMITTERS (1 << 5)    // PC5
+#define QTR_TIMEOUT 2000         // ticks (0.4 us), as given to pololu_3pi_init()
+#define QTR_CHARGE_US 10
+
+unsigned int qtr_frame[2][QTR_SENSORS];
+volatile unsigned char qtr_back;          // frame being captured
+volatile unsigned char qtr_pending;       // pins that haven't fallen yet
+volatile unsigned char qtr_ready;         // qtr_frame[!qtr_back] is new
+volatile unsigned char qtr_busy;          // a capture is running
+unsigned long qtr_start_ticks;            // get_ticks() when the discharge started
+unsigned long qtr_stamp[2];               // the same for each frame
+unsigned long qtr_frame_ticks;            // and for the frame last taken
+
+// Swaps the buffers, with interrupts off.
+void qtr_finish() {
+	unsigned char i;
+	for (i=0; i<QTR_SENSORS; i++) {
+		if (qtr_pending & (1 << i)) { qtr_frame[qtr_back][i] = QTR_TIMEOUT; }
+	}
+	qtr_pending = 0;
+	PCMSK1 &= ~QTR_PINS;
+	qtr_stamp[qtr_back] = qtr_start_ticks;
+	qtr_back ^= 1;
+	qtr_ready = 1;
+	qtr_busy = 0;
+}
+
+ISR(PCINT1_vect) {
+	unsigned long now;
+	unsigned char fell, i;
+	// get_ticks() turns interrupts back on, keep this one out meanwhile
+	PCICR &= ~(1 << PCIE1);
+	now = get_ticks() - qtr_start_ticks;
+	fell = qtr_pending & ~PINC;
+	if (now > QTR_TIMEOUT) { now = QTR_TIMEOUT; }
+	for (i=0; i<QTR_SENSORS; i++) {
+		if (fell & (1 << i)) { qtr_frame[qtr_back][i] = (unsigned int)now; }
+	}
+	qtr_pending &= ~fell;
+	cli();
+	if (qtr_busy && !qtr_pending) { qtr_finish(); }
+	PCICR |= (1 << PCIE1);
+}
+
+// Emitters on, and no capture running.
+void qtr_init() {
+	PORTC |= QTR_EMITTERS;
+	DDRC |= QTR_EMITTERS;
+	PCMSK1 &= ~QTR_PINS;
+	PCICR |= (1 << PCIE1);
+	qtr_back = 0;
+	qtr_ready = 0;
+	qtr_busy = 0;
+	qtr_pending = 0;
+	sei();
+}
+
+// Starts capturing a frame, unless one is on its way already.
+void qtr_start() {
+	unsigned char sreg = SREG;
+	cli();
+	if (qtr_busy) {
+		SREG = sreg;
+		return;
+	}
+	qtr_busy = 1;
+	SREG = sreg;
+	PORTC |= QTR_PINS;
+	DDRC |= QTR_PINS;
+	delay_us(QTR_CHARGE_US);
+	qtr_pending = QTR_PINS;
+	PCIFR = (1 << PCIF1);        // forget the rising edges
+	PCMSK1 |= QTR_PINS;
+	qtr_start_ticks = get_ticks();
+	DDRC &= ~QTR_PINS;           // let them discharge, no pull-ups
+	PORTC &= ~QTR_PINS;
+}
+
+// Returns 1 when a new frame can be taken.
+unsigned char qtr_poll() {
+	if (qtr_ready) { return 1; }
+	if (qtr_busy && get_ticks() - qtr_start_ticks > QTR_TIMEOUT) {
+		// what is still charged is as dark as it gets
+		cli();
+		if (qtr_busy) { qtr_finish(); }
+		sei();
+	}
+	return qtr_ready;
+}
+
+// Copies the newest frame into values, waiting for the capture in
+// progress if there is no new one (starting one if need be).
+void qtr_take(unsigned int *values) {
+	unsigned char i, front;
+	if (!qtr_ready) { qtr_start(); }
+	while (!qtr_poll()) { }
+	cli(); // a capture finishing now would swap the buffers
+	front = qtr_back ^ 1;
+	qtr_frame_ticks = qtr_stamp[front];
+	for (i=0; i<QTR_SENSORS; i++) { values[i] = qtr_frame[front][i]; }
+	qtr_ready = 0;
+	sei();
+}
+
+// A frame started after the call, for code that is not on the scheduler.
+void qtr_read(unsigned int *values) {
+	while (qtr_busy) { qtr_poll(); }
+	qtr_ready = 0;
+	qtr_take(values);
+}
@@ -0,0 +1,30 @@
+////////////////////////////////////////////////////////////////
+// Robot profiles
+// What tells one 3pi from the next, fixed when the firmware is built:
+// the wheel base the pose turns by and the motor model the wheel
+// tables start from, until the speed test (dead.c) measures both. As
+// preprocessor constants they fold into the code that uses them.
+// Pick a profile with -DROBOT=n (make ROBOT=n, or make dead-n.hex for
+// one firmware per robot); a new robot is a new block below. The
+// sensor row is the 3pi's five, the line code is written for it.
+
+#ifndef ROBOT
+#define ROBOT 493
+#endif
+
+#if ROBOT == 493
+// the robot the original kinematics were measured on
+#define ROBOT_WIDTH 820             // 0.1 mm between the wheels
+#define ROBOT_M2S_NUM 238           // speed = command*NUM/DENOM + INTERCEPT,
+#define ROBOT_M2S_DENOM 5           // 0.1 mm/s, with the battery at
+#define ROBOT_M2S_INTERCEPT -330
+#define ROBOT_REF_MV 5000           // this voltage
+#else
+#error "no profile for this ROBOT in robot.h"
+#endif
+
+// 2^32*1.6us/(2 pi w) in Q15, the turn in binary angle per 1.6 us
+// (pose.h's unit of time) for a difference of 1 in the wheel speeds
+// (0.1 mm/s) at width w (0.1 mm): 2^32*1.6e-6/(2 pi) is 1093.7125,
+// times 2^15 is 35838770
+#define ROBOT_TURN_SCALE(w) (35838770L/(w))
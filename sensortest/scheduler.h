@@ -0,0 +1,160 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+////////////////////////////////////////////////////////////////
+// Fixed-rate cooperative scheduler.
+// The control step is released from the timer 0 overflow interrupt.
+// Timer 0 already runs the motor PWM at 20 MHz/8/256 once the motors
+// are set up, so it overflows every 102.4 us; the interrupt adds that
+// to a phase accumulator and releases a step each time a full control
+// period has gone by, which keeps the average rate exact.
+// Background tasks (buttons, display, telemetry) run one at a time
+// in the slack between steps. They must be short: a step that is
+// released while the previous one is still pending counts as an
+// overrun.
+// A prefetch function can be started shortly before each release, to
+// have the step's input (a sensor frame) acquired by the time the step
+// begins. The interrupt only flags it, sched_wait() runs it ahead of
+// the tasks, so it may start up to one task late.
+// sched_ran says which tasks the last wait ran, for a replay of the
+// step (see telemetry.h): a task with a period longer than the
+// control period runs at most once per wait.
+
+#define SCHED_TICK 1024      // timer 0 overflow period, in 0.1 us
+#define SCHED_MAX_TASKS 6
+
+typedef struct {
+	void (*run)(void);
+	unsigned int period_ms;
+	unsigned long next;      // millis() when it is due again
+} sched_task;
+
+unsigned long sched_period;               // control period, in 0.1 us
+volatile unsigned long sched_phase;       // time since the last release
+volatile unsigned char sched_due;         // a control step is waiting
+volatile unsigned int sched_overruns;     // steps released while one was waiting
+volatile unsigned char sched_ovf;         // timer 0 overflows, for prof.h
+
+void (*sched_prefetch)(void);
+unsigned int sched_prefetch_lead;         // in 0.1 us
+unsigned char sched_prefetched;           // already flagged for the coming step
+volatile unsigned char sched_prefetch_due; // to be run by sched_wait()
+
+sched_task sched_tasks[SCHED_MAX_TASKS];
+unsigned char sched_ntasks;
+unsigned char sched_next_task;
+unsigned char sched_ran;                  // tasks run by the last sched_wait(), bit i for task i
+
+// Timing of the steps as they actually started, in microseconds
+unsigned long sched_last_start;           // get_ticks() at the last step
+unsigned int sched_step_us;               // time since the step before
+unsigned int sched_jitter_us;             // worst |step period - nominal|
+unsigned long sched_steps;
+
+ISR(TIMER0_OVF_vect) {
+	sched_ovf++;
+	sched_phase += SCHED_TICK;
+	if (sched_phase >= sched_period) {
+		sched_phase -= sched_period;
+		if (sched_due) { sched_overruns++; }
+		sched_due = 1;
+		sched_prefetched = 0;
+		sched_prefetch_due = 0;
+	}
+	if (sched_prefetch && !sched_prefetched && sched_phase + sched_prefetch_lead >= sched_period) {
+		sched_prefetched = 1;
+		sched_prefetch_due = 1;
+	}
+}
+
+// Starts releasing control steps at control_hz (16 to 9765 Hz, the
+// step timing below is kept in 16-bit microseconds).
+void sched_init(unsigned int control_hz) {
+	set_motors(0,0); // makes sure the motor timers are running
+	sched_period = 10000000UL/control_hz;
+	sched_phase = 0;
+	sched_due = 0;
+	sched_overruns = 0;
+	sched_jitter_us = 0;
+	sched_steps = 0;
+	sched_last_start = get_ticks();
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	TIMSK0 |= (1 << TOIE0);
+	sei();
+}
+
+// Runs prefetch lead_us (at most 6500) before each step.
+void sched_set_prefetch(void (*prefetch)(void), unsigned int lead_us) {
+	cli();
+	sched_prefetch_lead = lead_us*10;
+	sched_prefetched = 0;
+	sched_prefetch_due = 0;
+	sched_prefetch = prefetch;
+	sei();
+}
+
+void sched_stop() {
+	TIMSK0 &= ~(1 << TOIE0);
+}
+
+// Adds a background task run about every period_ms.
+void sched_add_task(void (*run)(void), unsigned int period_ms) {
+	if (sched_ntasks >= SCHED_MAX_TASKS) { return; }
+	sched_tasks[sched_ntasks].run = run;
+	sched_tasks[sched_ntasks].period_ms = period_ms;
+	sched_tasks[sched_ntasks].next = millis();
+	sched_ntasks++;
+}
+
+// Runs the next background task if it is due, returns 1 if it did.
+unsigned char sched_run_task() {
+	unsigned char i;
+	unsigned long now = millis();
+	for (i=0; i<sched_ntasks; i++) {
+		sched_task *t = &sched_tasks[sched_next_task];
+		unsigned char bit = 1 << sched_next_task;
+		sched_next_task = (sched_next_task+1 < sched_ntasks) ? sched_next_task+1 : 0;
+		if ((long)(now - t->next) >= 0) {
+			t->next += t->period_ms;
+			if ((long)(now - t->next) >= 0) { t->next = now + t->period_ms; } // fell behind
+			sched_ran |= bit;
+			t->run();
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Runs background tasks until the next control step is due,
+// sleeping when there is nothing to do, then records its timing.
+void sched_wait() {
+	unsigned long now;
+	unsigned int nominal = (unsigned int)(sched_period/10);
+	sched_ran = 0;
+	while (!sched_due) {
+		if (sched_prefetch_due) {
+			sched_prefetch_due = 0;
+			sched_prefetch();
+			continue;
+		}
+		if (sched_run_task()) { continue; }
+		cli();
+		if (!sched_due && !sched_prefetch_due) {
+			sleep_enable();
+			sei();
+			sleep_cpu(); // sei() lets exactly one instruction run first
+			sleep_disable();
+		}
+		sei();
+	}
+	sched_due = 0;
+
+	now = get_ticks();
+	sched_step_us = (unsigned int)ticks_to_microseconds(now - sched_last_start);
+	sched_last_start = now;
+	if (sched_steps++ > 0) {
+		unsigned int error = (sched_step_us > nominal) ? sched_step_us - nominal : nominal - sched_step_us;
+		if (error > sched_jitter_us) { sched_jitter_us = error; }
+	}
+}
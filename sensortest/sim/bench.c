@@ -0,0 +1,288 @@
+// Checks and times the integer kernels of the firmware: the trig,
+// the motor speed models, the line sensors, update_bounds() and
+// track_bounds().
+// Each one is compared with a floating point reference over its
+// input range (or a sample of it) and the worst error is checked
+// against a limit; the exit status is 1 if any is over.
+//
+// usage: bench [-q]
+// make bench also reports the host's time per call; -q (make test)
+// only checks. The times are the PC's, not the robot's.
+#define main dead_main
+#include "../dead.c"
+#undef main
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PI 3.14159265358979
+
+typedef struct {
+  const char *name;
+  long inputs;                    // i runs from 0 to inputs-1
+  double limit;                   // worst error allowed, in the kernel's units
+  double (*error)(long i);        // |kernel - reference| at input i
+  void (*call)(long i);           // the kernel alone, for the timing
+} kernel;
+
+volatile long sink;
+
+static double clip0(double v) { return (v > 0) ? v : 0; }
+
+// sin_bam(), every binary angle
+static double sin_bam_error(long i) {
+  return fabs(sin_bam(i) - TRIG_ONE * sin(i * PI / 32768));
+}
+static void sin_bam_call(long i) { sink = sin_bam(i); }
+
+// SinMilli() and CosMilli(), every milli-degree from -360 to 360
+static double sin_milli_error(long i) {
+  double r = (i - 360000) * PI / 180000;
+  double es = fabs(SinMilli(i - 360000) - TRIG_ONE * sin(r));
+  double ec = fabs(CosMilli(i - 360000) - TRIG_ONE * cos(r));
+  return (es > ec) ? es : ec;
+}
+static void sin_milli_call(long i) { sink = SinMilli(i - 360000); }
+
+// Sin() and Cos(), whole degrees from -720 to 720
+static double sin_deg_error(long i) {
+  double r = (i - 720) * PI / 180;
+  double es = fabs(Sin(i - 720) - 1000 * sin(r));
+  double ec = fabs(Cos(i - 720) - 1000 * cos(r));
+  return (es > ec) ? es : ec;
+}
+static void sin_deg_call(long i) { sink = Sin(i - 720); }
+
+// Atan2Milli(), every 0.01 degree around circles of 100 mm to 100 m,
+// as the homing uses it
+static long atan_x(long i) {
+  static const long radius[4] = {1000, 10000, 100000, 1000000};
+  return lround(radius[i / 36000] * sin((i % 36000) * PI / 18000));
+}
+static long atan_y(long i) {
+  static const long radius[4] = {1000, 10000, 100000, 1000000};
+  return lround(radius[i / 36000] * cos((i % 36000) * PI / 18000));
+}
+static double atan_error(long i) {
+  long x = atan_x(i), y = atan_y(i);
+  double e = fabs(Atan2Milli(x, y) - atan2(x, y) * 180000 / PI);
+  return (e > 180000) ? 360000 - e : e;
+}
+static void atan_call(long i) { sink = Atan2Milli(i - 18000, 20000); }
+
+// the speed models, every command; the reference is the line they
+// are drawn from, the robot profile's at boot
+static double speed_reference(int v) {
+  double s = clip0(((v < 0) ? -v : v) * (double)ROBOT_M2S_NUM / ROBOT_M2S_DENOM + ROBOT_M2S_INTERCEPT);
+  return (v < 0) ? -s : s;
+}
+static double original_reference(int v) {
+  double s = clip0(((v < 0) ? -v : v) * 238.0 / 5 - 330);
+  return (v < 0) ? -s : s;
+}
+static double wheel_speed_error(long i) { return fabs(wheel_speed(WHEEL_LEFT, i - 255) - speed_reference(i - 255)); }
+static void wheel_speed_call(long i) { sink = wheel_speed(WHEEL_LEFT, i - 255); }
+static double original_error(long i) { return fabs(original_motor2speed(i - 255) - original_reference(i - 255)); }
+static void original_call(long i) { sink = original_motor2speed(i - 255); }
+
+// Pseudo-random sensor readings, the same for a given i, around the
+// bounds set in main(): 0-2000 with some beyond either end.
+static void random_sensors(long i, unsigned int *s) {
+  unsigned long x = (unsigned long)i * 2654435761UL + 12345;
+  int k;
+  for (k = 0; k < 5; k++) {
+    x = (x * 1103515245UL + 12345) & 0xffffffffUL;
+    s[k] = (x >> 16) % 2200;
+    if (k > 0 && (x & 0x300) == 0) s[k] = s[k-1]; // some ties
+  }
+}
+
+// sensor_fraction(), on the frozen calibration, against the exact
+// 0-1280 fraction of the range
+static double sensor_fraction_error(long i) {
+  double e, worst = 0;
+  int k;
+  random_sensors(i, sensors);
+  for (k = 0; k < 5; k++) {
+    double v = (double)sensors[k] - minv[k], range = (double)maxv[k] - minv[k];
+    e = fabs(sensor_fraction(k) - ((v <= 0) ? 0 : (v >= range) ? 1280 : 1280 * v / range));
+    if (e > worst) worst = e;
+  }
+  return worst;
+}
+static void sensor_fraction_call(long i) {
+  random_sensors(i, sensors);
+  sink = sensor_fraction(i % 5);
+}
+
+// line_position(): the peak of the parabola through the same
+// fractions in floating point, around the sensors level with the
+// strongest; the last position on a cross mark, and where the line
+// was lost when no sensor is over its threshold
+static double line_position_error(long i) {
+  double f[5], l, m, r, expect;
+  int k, first = 0, end, seen = 0, last = line_last;
+  random_sensors(i, sensors);
+  for (k = 0; k < 5; k++) {
+    f[k] = sensor_fraction(k);
+    if (f[k] > f[first]) first = k;
+    if (sensors[k] >= line_threshold[k]) seen++;
+  }
+  for (end = first; end < 4 && f[end+1] == f[first]; end++) {}
+  if (seen > 3) {
+    expect = last;
+  } else if (!seen) {
+    expect = (last > LINE_LOST_EDGE) ? LINE_LOST : (last < -LINE_LOST_EDGE) ? -LINE_LOST : last;
+  } else {
+    l = first ? f[first-1] : 0;
+    m = f[first];
+    r = (end < 4) ? f[end+1] : 0;
+    expect = (first + end - 4) * 250 + ((l == r) ? 0 : 500 * (r - l) / (2 * (2*m - l - r)));
+  }
+  return fabs(line_position() - expect);
+}
+static void line_position_call(long i) {
+  random_sensors(i, sensors);
+  sink = line_position();
+}
+
+// update_bounds(), number of bounds that come out wrong
+static double update_bounds_error(long i) {
+  unsigned int s[5], lo[5], hi[5];
+  int k, wrong = 0;
+  random_sensors(i, s);
+  for (k = 0; k < 5; k++) {
+    lo[k] = 300 + 50 * k;
+    hi[k] = 1500 + 50 * k;
+  }
+  update_bounds(s, lo, hi);
+  for (k = 0; k < 5; k++) {
+    wrong += lo[k] != ((s[k] < 300 + 50 * k) ? s[k] : 300 + 50 * k);
+    wrong += hi[k] != ((s[k] > 1500 + 50 * k) ? s[k] : 1500 + 50 * k);
+  }
+  return wrong;
+}
+static void update_bounds_call(long i) {
+  unsigned int lo[5] = {1000, 1000, 1000, 1000, 1000}, hi[5] = {0};
+  random_sensors(i, sensors);
+  update_bounds(sensors, lo, hi);
+}
+
+// track_bounds() from fixed bounds, against the same rule in floating
+// point: worst error of a bound, raw units
+static double track_bounds_error(long i) {
+  unsigned int s[5];
+  double lo[5], hi[5], d, range, e = 0;
+  int k, peak = 0;
+  random_sensors(i, s);
+  for (k = 0; k < 5; k++) {
+    minv[k] = 100 + 20 * k;
+    maxv[k] = 1800 + 40 * k;
+    lo[k] = minv[k];
+    hi[k] = maxv[k];
+  }
+  freeze_calibration();
+  track_start();
+  for (k = 1; k < 5; k++) {
+    if (s[k] - lo[k] > s[peak] - lo[peak]) peak = k;
+  }
+  for (k = 0; k < 5; k++) {
+    range = hi[k] - lo[k];
+    if (k == peak && s[k] >= line_threshold[k]) {
+      d = s[k] - hi[k];
+      if (d < 0) hi[k] += d / 256;
+      else if (d < range / 4) hi[k] += d / 4;
+    } else if (abs(k - peak) > 1 && s[k] < line_threshold[k]) {
+      d = s[k] - lo[k];
+      if (d > 0) lo[k] += d / 256;
+      else if (d > -range / 4) lo[k] += d / 4;
+    }
+  }
+  track_bounds(s);
+  for (k = 0; k < 5; k++) {
+    if (fabs(minv[k] - lo[k]) > e) e = fabs(minv[k] - lo[k]);
+    if (fabs(maxv[k] - hi[k]) > e) e = fabs(maxv[k] - hi[k]);
+  }
+  return e;
+}
+static void track_bounds_call(long i) {
+  random_sensors(i, sensors);
+  track_bounds(sensors);
+}
+
+static void empty_call(long i) { sink = i; }
+
+// limits are what the code is meant to do, see the comments at each
+static const kernel kernels[] = {
+  {"sin_bam",             65536,  3, sin_bam_error, sin_bam_call},        // ~2/16384
+  {"SinMilli/CosMilli",  720000,  3, sin_milli_error, sin_milli_call},
+  {"Sin/Cos",              1441,  1, sin_deg_error, sin_deg_call},
+  {"Atan2Milli",       4L*36000, 20, atan_error, atan_call},              // 0.02 degree
+  {"wheel_speed",           511,  1, wheel_speed_error, wheel_speed_call},
+  {"original_motor2speed",  511,  1, original_error, original_call},
+  {"sensor_fraction",    100000,  1, sensor_fraction_error, sensor_fraction_call},
+  {"line_position",      100000,  1, line_position_error, line_position_call},
+  {"update_bounds",      100000,  0, update_bounds_error, update_bounds_call},
+  {"track_bounds",       100000,  1, track_bounds_error, track_bounds_call},  // Q8 bounds, truncated
+};
+#define KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+
+static double seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// ns per call over all the inputs, less the loop and the call itself
+static double ns_per_call(const kernel *t) {
+  double t0, dt, best = 1e30, empty = 1e30;
+  int rep;
+  long i;
+  for (rep = 0; rep < 3; rep++) {
+    t0 = seconds();
+    for (i = 0; i < t->inputs; i++) t->call(i);
+    dt = seconds() - t0;
+    if (dt < best) best = dt;
+    t0 = seconds();
+    for (i = 0; i < t->inputs; i++) empty_call(i);
+    dt = seconds() - t0;
+    if (dt < empty) empty = dt;
+  }
+  return (best > empty) ? (best - empty) * 1e9 / t->inputs : 0;
+}
+
+int main(int argc, char **argv) {
+  unsigned int k;
+  int failed = 0, quiet = 0;
+
+  quiet = (argc > 1 && !strcmp(argv[1], "-q"));
+
+  // the state the kernels run on
+  wheel_init();
+  for (k = 0; k < 5; k++) {
+    minv[k] = 100 + 20 * k;
+    maxv[k] = 1800 + 40 * k;
+  }
+  freeze_calibration();
+
+  printf("%-22s %8s %10s %6s%s\n", "kernel", "inputs", "worst", "limit", quiet ? "" : "  ns/call");
+  for (k = 0; k < KERNELS; k++) {
+    const kernel *t = &kernels[k];
+    long j;
+    double worst = 0;
+    for (j = 0; j < t->inputs; j++) {
+      double e = t->error(j);
+      if (e > worst) worst = e;
+    }
+    if (worst > t->limit) failed = 1;
+    printf("%-22s %8ld %10.3f %6.0f", t->name, t->inputs, worst, t->limit);
+    if (!quiet) printf(" %8.2f", ns_per_call(t));
+    printf("%s\n", (worst > t->limit) ? "  FAIL" : "");
+  }
+  printf(failed ? "FAILED\n" : "all within limits\n");
+  return failed;
+}
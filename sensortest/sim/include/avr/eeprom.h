@@ -0,0 +1,16 @@
+// Host stand-in for <avr/eeprom.h>.
+// The 1 KB EEPROM is simulator memory, erased (all 0xff) when a trial
+// starts unless sim_config names an image file, which is then loaded
+// at the start and gets the changes back at the end.
+#ifndef SIM_AVR_EEPROM_H
+#define SIM_AVR_EEPROM_H
+
+#include <stddef.h>
+
+#define E2END 0x3ff
+
+void eeprom_read_block(void *dst, const void *src, size_t n);
+// writes the bytes that differ, each taking 3.4 ms as on the robot
+void eeprom_update_block(const void *src, void *dst, size_t n);
+
+#endif
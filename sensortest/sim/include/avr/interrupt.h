@@ -0,0 +1,17 @@
+// Host stand-in for <avr/interrupt.h>.
+// An ISR becomes an ordinary function with a fixed name that the
+// simulator calls when the interrupt is enabled and due.
+#ifndef SIM_AVR_INTERRUPT_H
+#define SIM_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+#define ISR(vector, ...) void vector(void)
+#define sei() (SREG |= 0x80)
+#define cli() (SREG &= (uint8_t)~0x80)
+
+#define TIMER0_OVF_vect sim_isr_timer0_ovf
+#define USART_UDRE_vect sim_isr_usart_udre
+#define PCINT1_vect sim_isr_pcint1
+
+#endif
@@ -0,0 +1,39 @@
+// Host stand-in for <avr/io.h>.
+// The ATmega328P registers the firmware touches are plain variables
+// owned by the simulator, which looks at them to decide which
+// interrupts to raise.
+#ifndef SIM_AVR_IO_H
+#define SIM_AVR_IO_H
+
+#include <stdint.h>
+
+extern volatile uint8_t SREG;
+
+// timer/counter 0 (motor PWM, 20 MHz/8/256 on the 3pi). TCNT0
+// follows the simulated clock; TOV0 is never set, the simulator
+// raises the overflow interrupt itself.
+extern volatile uint8_t TCCR0A, TCCR0B, TCNT0, TIMSK0, TIFR0;
+#define TOIE0 0
+#define TOV0 0
+
+// port C: line sensors on PC0-PC4, their emitters on PC5. PINC
+// follows the simulated sensors; PCIFR is accepted but not modelled,
+// the simulator raises PCINT1 on each enabled pin change itself.
+extern volatile uint8_t DDRC, PORTC, PINC;
+extern volatile uint8_t PCICR, PCIFR, PCMSK1;
+#define PCIE1 1
+#define PCIF1 1
+
+// USART0. Writes to UDR0 are seen by the simulator, which keeps a
+// value above 0xff there while nothing new has been written.
+extern volatile uint16_t UBRR0, UDR0;
+extern volatile uint8_t UCSR0A, UCSR0B, UCSR0C;
+#define U2X0 1
+#define UDRE0 5
+#define UCSZ00 1
+#define UCSZ01 2
+#define TXEN0 3
+#define RXEN0 4
+#define UDRIE0 5
+
+#endif
@@ -0,0 +1,21 @@
+// Host stand-in for <avr/pgmspace.h>.
+// On the PC there is only one address space, so program memory
+// is ordinary const data and the pgm_read_* macros are plain loads.
+#ifndef SIM_AVR_PGMSPACE_H
+#define SIM_AVR_PGMSPACE_H
+
+#include <stdint.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+
+typedef char prog_char;
+typedef unsigned char prog_uchar;
+typedef int16_t prog_int16_t;
+typedef uint16_t prog_uint16_t;
+
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+
+#endif
@@ -0,0 +1,16 @@
+// Host stand-in for <avr/sleep.h>.
+// Sleeping lets simulated time run to the next timer interrupt.
+#ifndef SIM_AVR_SLEEP_H
+#define SIM_AVR_SLEEP_H
+
+#define SLEEP_MODE_IDLE 0
+
+void sim_sleep(void);
+
+#define set_sleep_mode(mode) ((void)(mode))
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu() sim_sleep()
+#define sleep_mode() sim_sleep()
+
+#endif
@@ -0,0 +1,65 @@
+// Host stand-in for <pololu/3pi.h>.
+// Declares the subset of the Pololu AVR library used by the 3pi
+// programs in this directory. The definitions live in sim/sim3pi.c,
+// where every call that takes time on the robot (sensor reads,
+// delays, LCD writes) advances the simulated clock instead.
+#ifndef SIM_POLOLU_3PI_H
+#define SIM_POLOLU_3PI_H
+
+#include <avr/pgmspace.h>
+
+// buttons, same bit masks as on the robot (port B pins)
+#define BUTTON_A (1 << 1)
+#define BUTTON_B (1 << 4)
+#define BUTTON_C (1 << 5)
+#define ALL_BUTTONS (BUTTON_A | BUTTON_B | BUTTON_C)
+#define ANY_BUTTON ALL_BUTTONS
+
+// line sensor read modes
+#define IR_EMITTERS_OFF 0
+#define IR_EMITTERS_ON 1
+#define IR_EMITTERS_ON_AND_OFF 2
+
+void pololu_3pi_init(unsigned int line_sensor_timeout);
+
+// line sensors
+void read_line_sensors(unsigned int *sensor_values, unsigned char read_mode);
+void emitters_on(void);
+void emitters_off(void);
+
+// motors
+void set_motors(int left, int right);
+
+// battery
+int read_battery_millivolts(void);
+
+// time
+unsigned long millis(void);
+unsigned long get_ticks(void);
+unsigned long ticks_to_microseconds(unsigned long ticks);
+void delay_ms(unsigned int milliseconds);
+void delay_us(unsigned int microseconds);
+#define delay(ms) delay_ms(ms)
+
+// buttons
+unsigned char button_is_pressed(unsigned char buttons);
+unsigned char wait_for_button_press(unsigned char buttons);
+unsigned char wait_for_button_release(unsigned char buttons);
+unsigned char wait_for_button(unsigned char buttons);
+
+// LCD
+void clear(void);
+void print(const char *str);
+void print_from_program_space(const char *str);
+void print_character(char c);
+void print_long(long value);
+void print_unsigned_long(unsigned long value);
+void lcd_goto_xy(int col, int row);
+void lcd_load_custom_character(const char *picture, unsigned char number);
+
+// buzzer
+void play(const char *notes);
+void play_from_program_space(const char *notes);
+unsigned char is_playing(void);
+
+#endif
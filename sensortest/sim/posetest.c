@@ -0,0 +1,162 @@
+// Drift of the dead reckoning against the loop rate.
+// Drives a minute of smoothly varying motor commands, changed every
+// control step as the line follower does, with the step timing
+// jittered like the scheduler's. The commands are integrated exactly
+// (the wheels approach their wheel_speed() speeds with the first order
+// lag of pose.h, and every 0.1 ms piece is an arc at the exact mean
+// speeds over it) and compared with three estimators fed the same
+// steps:
+//   original  the baseline dead.c: whole-millisecond steps and
+//             whole-degree Sin/Cos, 1/10 mm positions
+//   previous  update_pose() before pose.h: microsecond steps,
+//             milli-degree trig, still truncating every step
+//   pose.h    fractional accumulators and arc steps
+// The first two also take the speed of the mean command, which is off
+// while a wheel is in the dead band, and the speed model of the time,
+// original_motor2speed() and original_motor2angle().
+// The first two know nothing of the lag either. Nothing here models
+// the robot itself beyond it (slip), only the arithmetic of the
+// estimators.
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../calibration.h"
+#include "../pose.h"
+
+// calibration.h reads the battery, which stays at battery_ref_mv here
+int read_battery_millivolts() { return 5000; }
+
+#define PI 3.14159265358979
+#define TICKS_PER_S 2500000L     // get_ticks() runs at 2.5 MHz
+#define RUN_S 60
+#define MILLION 1000000
+#define TRUE_STEP 1e-4           // s
+
+typedef struct {
+  long x, y, theta;              // 0.1 mm, milli-degrees
+} legacy_pose;
+
+// baseline dead.c, deltaTime in ms
+static void original_step(legacy_pose *p, int l, int r, long deltaTime) {
+  long marginalTheta = original_motor2angle(l, r)*deltaTime;
+  long newTheta = p->theta + marginalTheta;
+  long alpha = (p->theta + newTheta)/2;
+  long speedCalc = deltaTime*original_motor2speed((l+r)/2);
+  p->x += (long)(Sin(alpha/1000)*speedCalc)/MILLION;
+  p->y += (long)(Cos(alpha/1000)*speedCalc)/MILLION;
+  p->theta = newTheta;
+}
+
+// update_pose() as it was, deltaTime in us
+static void previous_step(legacy_pose *p, int l, int r, unsigned long deltaTime) {
+  long marginalTheta = original_motor2angle(l, r)*(long)deltaTime/1000;
+  long alpha = (p->theta + p->theta + marginalTheta)/2;
+  long speedCalc = (long)deltaTime*original_motor2speed((l+r)/2)/16000;
+  p->x += (speedCalc*SinMilli(alpha))/1024000;
+  p->y += (speedCalc*CosMilli(alpha))/1024000;
+  p->theta += marginalTheta;
+}
+
+// exact, x/y in 0.1 mm and heading in radians clockwise from +y,
+// wheel speeds in 0.1 mm/s
+typedef struct { double x, y, h, vl, vr; } true_pose;
+
+static void true_arc(true_pose *p, double vl, double vr, double dt) {
+  double v = (vl + vr)/2, w = (vl - vr)/robot_width;
+  if (fabs(w*dt) < 1e-9) {
+    p->x += v*dt*sin(p->h);
+    p->y += v*dt*cos(p->h);
+  } else {
+    p->x += v/w*(cos(p->h) - cos(p->h + w*dt));
+    p->y += v/w*(sin(p->h + w*dt) - sin(p->h));
+  }
+  p->h += w*dt;
+}
+
+static void true_step(true_pose *p, int l, int r, double dt) {
+  double tl = wheel_speed(WHEEL_LEFT, l), tr = wheel_speed(WHEEL_RIGHT, r);
+  double taul = wheel_tau_ms[WHEEL_LEFT]/1000.0, taur = wheel_tau_ms[WHEEL_RIGHT]/1000.0;
+  while (dt > 0) {
+    double h = (dt < TRUE_STEP) ? dt : TRUE_STEP;
+    double el = exp(-h/taul), ml = taul/h*(1 - el);  // mean of e^(-t/tau) over h
+    double er = exp(-h/taur), mr = taur/h*(1 - er);
+    true_arc(p, tl + (p->vl - tl)*ml, tr + (p->vr - tr)*mr, h);
+    p->vl = tl + (p->vl - tl)*el;
+    p->vr = tr + (p->vr - tr)*er;
+    dt -= h;
+  }
+}
+
+static double angle_error_deg(double mdeg, double rad) {
+  double e = fmod(mdeg/1000 - rad*180/PI, 360);
+  if (e > 180) e -= 360;
+  if (e < -180) e += 360;
+  return fabs(e);
+}
+
+int main() {
+  static const int rates[] = {50, 100, 200, 500, 1000};
+  unsigned int k;
+
+  wheel_init();
+  wheel_tau_ms[WHEEL_RIGHT] = 90; // each wheel has its own lag
+
+  printf("%6s  %-9s %12s %12s %12s\n", "hz", "estimator", "final_mm", "worst_mm", "heading_deg");
+  for (k = 0; k < sizeof(rates)/sizeof(rates[0]); k++) {
+    int hz = rates[k];
+    long period = TICKS_PER_S/hz;
+    unsigned long ticks = 0;
+    long ms_carry = 0;
+    legacy_pose orig = {0, 0, 0}, prev = {0, 0, 0};
+    true_pose truth = {0, 0, 0, 0, 0};
+    double worst[3] = {0, 0, 0};
+    int l = 0, r = 0, e;
+    double t = 0;
+
+    srand(1);
+    pose_init(0);
+    while (t < RUN_S) {
+      // this step lasts the nominal period give or take 5%
+      long dt = period + (rand() % (period/10 + 1)) - period/20;
+      double d[3][2];
+
+      // the command in effect over [t, t+dt) was set at t
+      {
+        int speed = 60 + (int)(25*sin(2*PI*t/7.3));
+        int turn = (int)(30*sin(2*PI*t/2.9) + 10*sin(2*PI*t/0.7));
+        l = speed + turn;
+        r = speed - turn;
+      }
+      pose_command(l, r);
+
+      ticks += dt;
+      pose_advance(ticks);
+      t += (double)dt/TICKS_PER_S;
+      true_step(&truth, l, r, (double)dt/TICKS_PER_S);
+      // the original counted whole milliseconds, carrying the rest
+      ms_carry += dt;
+      original_step(&orig, l, r, ms_carry/2500);
+      ms_carry %= 2500;
+      previous_step(&prev, l, r, (unsigned long)(dt*2/5));
+
+      d[0][0] = orig.x - truth.x; d[0][1] = orig.y - truth.y;
+      d[1][0] = prev.x - truth.x; d[1][1] = prev.y - truth.y;
+      d[2][0] = pose_x/256.0 - truth.x; d[2][1] = pose_y/256.0 - truth.y;
+      for (e = 0; e < 3; e++) {
+        double m = hypot(d[e][0], d[e][1])/10;
+        if (m > worst[e]) worst[e] = m;
+      }
+    }
+
+    printf("%6d  %-9s %12.1f %12.1f %12.3f\n", hz, "original",
+           hypot(orig.x - truth.x, orig.y - truth.y)/10, worst[0],
+           angle_error_deg(orig.theta, truth.h));
+    printf("%6d  %-9s %12.1f %12.1f %12.3f\n", hz, "previous",
+           hypot(prev.x - truth.x, prev.y - truth.y)/10, worst[1],
+           angle_error_deg(prev.theta, truth.h));
+    printf("%6d  %-9s %12.2f %12.2f %12.3f\n", hz, "pose.h",
+           hypot(pose_x/256.0 - truth.x, pose_y/256.0 - truth.y)/10, worst[2],
+           angle_error_deg(pose_heading_mdeg(), truth.h));
+  }
+  return 0;
+}
@@ -0,0 +1,345 @@
+// Replays a telemetry capture (telemetry.h) through the line following
+// of dead.c, included here unchanged as in sim/bench.c, and checks
+// that every step comes out the same, bit for bit.
+// The start frames give the state the robot started following the
+// line from; each step frame then gives the step's sensor frame, when
+// it was taken and when the motors were set, the background tasks
+// that ran before the step and what the buttons and the battery read.
+// The simulator (sim3pi.h) is in replay mode: its clock stands at the
+// ticks of the capture and the robot model is left out. The telemetry
+// frame the step builds must then match the captured one to the byte,
+// inputs, motor commands, line position and pose alike. The replay
+// ends with the line, the drive home after it is not replayed.
+//
+// Frames lost on the way (a gap in the sequence numbers) don't end
+// the replay: it takes the run up again from the first step frame
+// after them (see resync()), but from there on it is only close to
+// what the robot did, so those steps are counted apart and don't stop
+// it.
+//
+// usage: replay [-k] [-o capture] capture
+// Replays the first run in the capture. It stops at the first step
+// that differs, or with -k keeps feeding the captured inputs in, to
+// see what changed control code makes of them (from the first
+// difference on, it is no longer the run the robot drove). With -o the
+// replayed frames are saved as a capture, for sim/teledecode. The exit
+// status is 1 if a step before the first gap differed.
+#define main dead_main
+#include "../dead.c"
+#undef main
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "sim3pi.h"
+
+#define MAX_SHOWN 10   // differing steps printed with -k
+
+typedef struct {
+  unsigned char type, seq;
+  const unsigned char *p;       // payload
+} frame;
+
+static frame *frames;
+static long nframes, corrupt;
+
+// step frame fields, for telling what differs
+static const struct {
+  const char *name;
+  int at, size, sign;
+} fields[] = {
+  { "ticks", 0, 4, 0 }, { "s0", 4, 2, 0 }, { "s1", 6, 2, 0 }, { "s2", 8, 2, 0 },
+  { "s3", 10, 2, 0 }, { "s4", 12, 2, 0 }, { "position", 14, 2, 1 }, { "offset", 16, 2, 1 },
+  { "left", 18, 2, 1 }, { "right", 20, 2, 1 }, { "x", 22, 4, 1 }, { "y", 26, 4, 1 },
+  { "theta", 30, 4, 1 }, { "frame", 34, 2, 1 }, { "drive", 36, 2, 0 }, { "tasks", 38, 1, 0 },
+  { "buttons", 39, 1, 0 }, { "battery", 40, 2, 0 }
+};
+
+static unsigned long u16(const unsigned char *p) { return p[0] | (unsigned long)p[1] << 8; }
+static long s16(const unsigned char *p) { return (short)u16(p); }
+static unsigned long u32(const unsigned char *p) { return u16(p) | u16(p + 2) << 16; }
+
+static long field(const unsigned char *p, int f) {
+  const unsigned char *q = p + fields[f].at;
+  if (fields[f].size == 1) return *q;
+  if (fields[f].size == 2) return fields[f].sign ? s16(q) : (long)u16(q);
+  return fields[f].sign ? (long)(int)u32(q) : (long)u32(q);
+}
+
+static int payload_size(int type) {
+  if (type == TELEMETRY_STEP) return TELEMETRY_STEP_SIZE;
+  if (type == TELEMETRY_PROFILE) return TELEMETRY_PROFILE_SIZE;
+  if (type == TELEMETRY_START) return TELEMETRY_START_SIZE;
+  if (type == TELEMETRY_WHEEL) return TELEMETRY_WHEEL_SIZE;
+  if (type == TELEMETRY_MAP) return TELEMETRY_MAP_SIZE;
+  if (type == TELEMETRY_GAINS) return TELEMETRY_GAINS_SIZE;
+  return -1;
+}
+
+// Splits the capture into frames, skipping bytes that don't make one.
+static void parse(const unsigned char *b, long n) {
+  long i = 0, j;
+  frames = malloc((n / 5 + 1) * sizeof(*frames));
+  while (i + 5 <= n) {
+    int size = (b[i] == 0xA5 && b[i+1] == 0x5A) ? payload_size(b[i+2]) : -1;
+    unsigned char sum = 0;
+    if (size < 0 || i + 5 + size > n) {
+      i++;
+      continue;
+    }
+    for (j = i + 2; j < i + 5 + size; j++) sum += b[j];
+    if (sum) {
+      corrupt++;
+      i++;
+      continue;
+    }
+    frames[nframes].type = b[i+2];
+    frames[nframes].seq = b[i+3];
+    frames[nframes].p = b + i + 4;
+    nframes++;
+    i += 5 + size;
+  }
+}
+
+static void write_frame(FILE *f, int type, int seq, const unsigned char *p) {
+  int i, size = payload_size(type);
+  unsigned char sum = type + seq;
+  for (i = 0; i < size; i++) sum += p[i];
+  fputc(0xA5, f);
+  fputc(0x5A, f);
+  fputc(type, f);
+  fputc(seq, f);
+  fwrite(p, 1, size, f);
+  fputc(-sum & 0xff, f);
+}
+
+// Puts the firmware in the state the start frame at 'at' and those
+// after it describe, as main() had it before its first step. Returns
+// the frame after them, or -1 if they are incomplete.
+static long start(long at) {
+  const unsigned char *p = frames[at].p;
+  int i, k, wheels = 0, gains = 0, runs = -1;
+  long f;
+  for (f = at + 1; f < nframes && frames[f].type != TELEMETRY_STEP; f++) {
+    const unsigned char *q = frames[f].p;
+    if (frames[f].seq != (unsigned char)(frames[f-1].seq + 1)) return -1;
+    if (frames[f].type == TELEMETRY_WHEEL && q[0] < 2) {
+      for (i = 0; i < WHEEL_POINTS; i++) wheel_base[q[0]][i] = s16(q + 1 + 2*i);
+      wheel_tau_ms[q[0]] = u16(q + 1 + 2*WHEEL_POINTS);
+      wheels |= 1 << q[0];
+    }
+    if (frames[f].type == TELEMETRY_GAINS) {
+      for (i = 0; i < PID_BANDS; i++) {
+        pid_band_gains[i].kp = s16(q + 6*i);
+        pid_band_gains[i].ki = s16(q + 6*i + 2);
+        pid_band_gains[i].kd = s16(q + 6*i + 4);
+      }
+      gains = 1;
+    }
+    if (frames[f].type == TELEMETRY_MAP && q[1] <= MAP_RUNS) {
+      map.n = q[1];
+      map.speed = q[2];
+      for (k = 0; k < TELEMETRY_MAP_RUNS && q[0] + k < MAP_RUNS; k++) {
+        map.runs[q[0] + k].steps = q[3 + 3*k];
+        map.runs[q[0] + k].turn = s16(q + 4 + 3*k);
+      }
+      runs = q[0] + TELEMETRY_MAP_RUNS;
+    }
+  }
+  if (wheels != 3 || !gains || runs < map.n || f == nframes) return -1;
+
+  display_init();
+  sim_replay_set(u32(p), 0, u16(p + 4));
+  battery_update(); // the one reading at boot
+  wheel_refresh();
+  if (p[6]) map_learn_start(); else map_plan();
+  line_last = s16(p + 7);
+  for (i = 0; i < 5; i++) {
+    minv[i] = u16(p + 9 + 2*i);
+    maxv[i] = u16(p + 19 + 2*i);
+  }
+  width_set(u16(p + 29));
+  freeze_calibration();
+  follow_start();
+  return f;
+}
+
+// Takes the run up again after lost frames, at the step frame p: the
+// pose, the motors and the line as it logged them are where the next
+// step starts from, and the distance driven goes straight across the
+// gap. The rest (the PID's integral, the modelled wheel speeds, the
+// event detector, the sensor bounds) carries on from before the gap.
+static void resync(const unsigned char *p) {
+  unsigned long ticks = u32(p);
+  long x = (int)u32(p + 22), y = (int)u32(p + 26), mdeg = (int)u32(p + 30);
+  double dx = x - xPos, dy = y - yPos;
+  int i;
+
+  sim_replay_set(ticks, p[39], u16(p + 40));
+  sched_last_start = ticks;
+  for (i = 0; i < QTR_SENSORS; i++) sensors[i] = u16(p + 4 + 2*i);
+  follow_position = line_last = s16(p + 14);
+  follow_offset = s16(p + 16);
+  line_pid.last = follow_position;
+
+  pose_dist += (long)(sqrt(dx*dx + dy*dy) * (1 << POSE_FRAC));
+  pose_x = x << POSE_FRAC;
+  pose_y = y << POSE_FRAC;
+  // the middle of the headings that log as mdeg (pose_heading_mdeg())
+  pose_heading = ((unsigned long)(lround(mdeg * 1024.0 / 5625) & 0xffff) << 16) | 0x8000;
+  xPos = x;
+  yPos = y;
+  theta = mdeg;
+  motor_left = pose_left = s16(p + 18);
+  motor_right = pose_right = s16(p + 20);
+  motor_stamp = pose_stamp = ticks + u16(p + 36);
+  pose_vl = (long)wheel_speed(WHEEL_LEFT, motor_left) << 12;   // settled
+  pose_vr = (long)wheel_speed(WHEEL_RIGHT, motor_right) << 12;
+}
+
+int main(int argc, char **argv) {
+  sim_config cfg;
+  FILE *in, *out = 0;
+  unsigned char *capture;
+  long size, f, first, steps = 0, differ = 0;
+  long lost = 0, gaps = 0, steps_after = 0, differ_after = 0, worst_after = 0;
+  int opt, keep_going = 0, i, k, gap = 0;
+  unsigned char event = EV_NONE;
+  const char *until = "the capture ends before the line does";
+  unsigned long start_ticks, end_ticks;
+  double wall_ms;
+  clock_t t0;
+
+  while ((opt = getopt(argc, argv, "ko:")) != -1) {
+    if (opt == 'k') keep_going = 1;
+    else if (opt == 'o') {
+      if (!(out = fopen(optarg, "wb"))) {
+        perror(optarg);
+        return 1;
+      }
+    } else {
+      optind = argc;
+      break;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-k] [-o capture] capture\n", argv[0]);
+    return 1;
+  }
+  if (!(in = fopen(argv[optind], "rb"))) {
+    perror(argv[optind]);
+    return 1;
+  }
+  fseek(in, 0, SEEK_END);
+  size = ftell(in);
+  rewind(in);
+  capture = malloc(size + 1);
+  if (fread(capture, 1, size, in) != (size_t)size) {
+    perror(argv[optind]);
+    return 1;
+  }
+  fclose(in);
+  parse(capture, size);
+
+  for (f = 0; f < nframes && frames[f].type != TELEMETRY_START; f++) {}
+  if (f == nframes) {
+    fprintf(stderr, "%s: no start frame, nothing to replay\n", argv[optind]);
+    return 1;
+  }
+  sim_config_default(&cfg);
+  sim_init(&cfg);
+  sim_replay_begin();
+  first = f;
+  if ((f = start(first)) < 0) {
+    fprintf(stderr, "%s: the start frames are incomplete\n", argv[optind]);
+    return 1;
+  }
+  if (out) {
+    for (k = first; k < f; k++) write_frame(out, frames[k].type, frames[k].seq, frames[k].p);
+  }
+
+  start_ticks = end_ticks = u32(frames[f].p);
+  t0 = clock();
+  for (; f < nframes && event != EV_END; f++) {
+    const unsigned char *p = frames[f].p;
+    unsigned long ticks = u32(p);
+    if (frames[f].seq != (unsigned char)(frames[f-1].seq + 1)) {
+      lost += (unsigned char)(frames[f].seq - frames[f-1].seq - 1);   // mod 256
+      gaps++;
+      gap = 1;
+    }
+    if (frames[f].type != TELEMETRY_STEP) continue; // profiler reports
+    if (gap) {
+      resync(p);
+      gap = 0;
+      if (out) write_frame(out, TELEMETRY_STEP, frames[f].seq, p);
+      end_ticks = ticks;
+      continue;
+    }
+
+    // the tasks that ran while the scheduler waited for the step
+    sim_replay_set(ticks, p[39], u16(p + 40));
+    for (k = 0; k < sched_ntasks; k++) {
+      if (p[38] & (1 << k)) sched_tasks[k].run();
+    }
+    sched_ran = p[38];
+    sched_last_start = ticks;
+    // the sensor frame, as the prefetch left it
+    qtr_back = 0;
+    qtr_ready = 1;
+    qtr_stamp[1] = ticks + s16(p + 34);
+    for (i = 0; i < QTR_SENSORS; i++) qtr_frame[1][i] = u16(p + 4 + 2*i);
+    // and the clock where it was when the motors were set
+    sim_replay_set(ticks + u16(p + 36), p[39], u16(p + 40));
+    event = follow_step();
+    telemetry_tail = telemetry_head;
+
+    if (out) write_frame(out, TELEMETRY_STEP, frames[f].seq, telemetry_frame + 4);
+    end_ticks = ticks;
+    if (gaps) {
+      // only close to the run since the gap, not expected to match
+      steps_after++;
+      if (telemetry_len != 5 + TELEMETRY_STEP_SIZE || memcmp(telemetry_frame + 4, p, TELEMETRY_STEP_SIZE)) {
+        differ_after++;
+        for (k = 8; k <= 9; k++) { // the motor commands
+          long d = labs(field(p, k) - field(telemetry_frame + 4, k));
+          if (d > worst_after) worst_after = d;
+        }
+      }
+    } else if (telemetry_len != 5 + TELEMETRY_STEP_SIZE || memcmp(telemetry_frame + 4, p, TELEMETRY_STEP_SIZE)) {
+      if (differ++ < MAX_SHOWN) {
+        printf("step %ld at %.3f s differs:", steps, (ticks - start_ticks) * 4e-7);
+        for (k = 0; k < (int)(sizeof(fields) / sizeof(fields[0])); k++) {
+          long was = field(p, k), now = field(telemetry_frame + 4, k);
+          if (was != now) printf(" %s %ld (was %ld)", fields[k].name, now, was);
+        }
+        printf("\n");
+      }
+      if (!keep_going) {
+        until = "up to the first difference";
+        steps++;
+        break;
+      }
+    }
+    steps++;
+    if (event == EV_END) until = "to the end of the line";
+  }
+  wall_ms = (clock() - t0) * 1000.0 / CLOCKS_PER_SEC;
+  if (out) fclose(out);
+
+  printf("%ld steps, %.2f s of the run, replayed in %.1f ms", steps,
+         (end_ticks - start_ticks) * 4e-7, wall_ms);
+  if (wall_ms > 0) printf(" (%.0fx real time)", (end_ticks - start_ticks) * 4e-4 / wall_ms);
+  printf(", %s\n", until);
+  if (corrupt) printf("%ld corrupt frames skipped\n", corrupt);
+  if (gaps) {
+    printf("gaps: %ld, %ld frames lost, taken up again after each: %ld of the %ld steps since differ,"
+           " the motor commands by up to %ld\n", gaps, lost, differ_after, steps_after, worst_after);
+  }
+  if (differ) printf("%ld of them differ\n", differ);
+  else printf(gaps ? "all identical up to the first gap\n" : "all identical\n");
+  return differ ? 1 : 0;
+}
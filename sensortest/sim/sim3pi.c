@@ -0,0 +1,946 @@
+// Host-side 3pi simulator: robot model, track and the
+// pololu/3pi.h stand-in functions used by the firmware.
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pololu/3pi.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include "sim3pi.h"
+
+////////////////////////////////////////////////////////////////
+// Robot geometry and timing constants
+
+#define SENSOR_AHEAD 40.0      // mm from the axle to the sensor row
+#define SENSOR_SPACING 10.0    // mm between neighbouring sensors
+#define SENSOR_SPOT 4.0        // mm, width of the soft edge of a sensor spot
+#define REFLECT_WHITE 0.9      // reflectance of the floor
+#define REFLECT_BLACK 0.075    // and of the tape
+#define RAW_SCALE 135.0        // raw reading for a unit of light: 150 over white, 1800 over tape
+#define GRID_CELL 16.0         // mm, track lookup grid
+#define PHYSICS_STEP_NS 500000 // longest physics integration step
+#define LAP_CHECK_NS 2000000   // lap and line loss bookkeeping interval
+
+// time taken on the robot by the library calls, in microseconds
+#define COST_CALL 2.0
+#define COST_EMITTERS 200.0
+#define COST_TICK_US 0.4       // one raw sensor unit is one 0.4us timer tick
+#define COST_LCD_CLEAR 2000.0
+#define COST_LCD_CHAR 100.0
+#define COST_LCD_CUSTOM 500.0
+#define COST_INIT 10000.0
+#define COST_EEPROM_WRITE 3400.0
+
+#define PI 3.14159265358979
+
+////////////////////////////////////////////////////////////////
+// Simulator state
+
+static sim_config cfg;
+static sim_robot robot;
+static unsigned long long now_ns;
+static unsigned long long next_lap_check;
+static unsigned long long next_tick;    // next timer overflow
+static unsigned long long limit_ns;
+static unsigned long long robot_ns; // time the robot model has been integrated to
+static unsigned long rng;
+static unsigned int sensor_timeout = 2000;
+static double sensor_gain[SIM_SENSORS];
+
+static unsigned char eeprom[E2END + 1];
+static int eeprom_dirty;
+
+static char lcd[2][9];
+static int lcd_x, lcd_y;
+
+// replay mode
+static int replaying;
+static unsigned char replay_buttons;
+static int replay_mv;
+
+// lap bookkeeping
+static double start_progress;
+static int lap_piece;
+static unsigned long long next_full_search;
+static double lap_start_ms = -1;
+static double lap_end_ms = -1;
+static int line_lost;
+static int line_losses;
+
+// simple xorshift, so runs are reproducible from the seed
+static double sim_random() {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return (double)(rng & 0xffffff) / (double)0x1000000;
+}
+
+////////////////////////////////////////////////////////////////
+// Track
+
+void sim_track_begin(sim_track *t, double x, double y, double heading, double width) {
+  free(t->cell_start);
+  free(t->cell_items);
+  memset(t, 0, sizeof(*t));
+  t->n = 1;
+  t->x[0] = x;
+  t->y[0] = y;
+  t->s[0] = 0;
+  t->width = width;
+  t->heading = heading * PI / 180;
+}
+
+static void track_add(sim_track *t, double x, double y) {
+  int n = t->n;
+  if (n >= SIM_MAX_POINTS) {
+    fprintf(stderr, "sim: track has too many points\n");
+    exit(1);
+  }
+  t->x[n] = x;
+  t->y[n] = y;
+  t->s[n] = t->s[n-1] + hypot(x - t->x[n-1], y - t->y[n-1]);
+  t->gap[n] = 0;
+  t->n = n + 1;
+}
+
+void sim_track_straight(sim_track *t, double length) {
+  int n = t->n - 1;
+  track_add(t, t->x[n] + length*sin(t->heading), t->y[n] + length*cos(t->heading));
+}
+
+void sim_track_arc(sim_track *t, double radius, double degrees) {
+  int i;
+  int steps = (int)ceil(fabs(degrees) / 2);
+  double step = degrees * PI / 180 / steps;
+  for (i = 0; i < steps; i++) {
+    // chord of a 2 degree slice, taken along the mid-slice heading
+    double chord = 2 * radius * sin(fabs(step) / 2);
+    int n = t->n - 1;
+    t->heading += step / 2;
+    track_add(t, t->x[n] + chord*sin(t->heading), t->y[n] + chord*cos(t->heading));
+    t->heading += step / 2;
+  }
+}
+
+void sim_track_gap(sim_track *t, double length) {
+  sim_track_straight(t, length);
+  t->gap[t->n - 1] = 1;
+}
+
+void sim_track_bar(sim_track *t, double length, double width) {
+  sim_bar *b;
+  if (t->nbars >= SIM_MAX_BARS) {
+    fprintf(stderr, "sim: track has too many cross marks\n");
+    exit(1);
+  }
+  b = &t->bars[t->nbars++];
+  b->x = t->x[t->n - 1];
+  b->y = t->y[t->n - 1];
+  b->ux = cos(t->heading); // square to the line
+  b->uy = -sin(t->heading);
+  b->half_length = length / 2;
+  b->half_width = width / 2;
+}
+
+void sim_track_calibration(sim_track *t, double gap) {
+  sim_track_straight(t, 100);
+  sim_track_gap(t, gap);
+  sim_track_straight(t, 200 - gap);
+  sim_track_gap(t, gap);
+  sim_track_straight(t, 100);
+}
+
+double sim_track_length(const sim_track *t) {
+  return t->s[t->n - 1];
+}
+
+// The robot boots at the origin sitting on the line.
+void sim_track_default(sim_track *t) {
+  sim_track_begin(t, 0, -40, 0, 19);
+  sim_track_straight(t, 440);
+  sim_track_arc(t, 250, 90);
+  sim_track_straight(t, 300);
+  sim_track_arc(t, 300, -60);
+  sim_track_straight(t, 250);
+  sim_track_end(t);
+}
+
+// bounding box of a piece or cross mark
+static void item_box(const sim_track *t, int item, double *x0, double *y0, double *x1, double *y1) {
+  if (item >= 0) {
+    *x0 = fmin(t->x[item-1], t->x[item]);
+    *x1 = fmax(t->x[item-1], t->x[item]);
+    *y0 = fmin(t->y[item-1], t->y[item]);
+    *y1 = fmax(t->y[item-1], t->y[item]);
+  } else {
+    const sim_bar *b = &t->bars[-1 - item];
+    double ex = fabs(b->ux) * b->half_length + fabs(b->uy) * b->half_width;
+    double ey = fabs(b->uy) * b->half_length + fabs(b->ux) * b->half_width;
+    *x0 = b->x - ex;
+    *x1 = b->x + ex;
+    *y0 = b->y - ey;
+    *y1 = b->y + ey;
+  }
+}
+
+// Grid cells within reach of the item: stores them in cells (when
+// given) and returns how many there are.
+static int item_cells(const sim_track *t, int item, int *cells) {
+  double x0, y0, x1, y1, reach = t->width / 2 + SENSOR_SPOT;
+  int cx, cy, n = 0;
+  item_box(t, item, &x0, &y0, &x1, &y1);
+  for (cy = (int)((y0 - reach - t->grid_y) / GRID_CELL); cy <= (int)((y1 + reach - t->grid_y) / GRID_CELL); cy++) {
+    for (cx = (int)((x0 - reach - t->grid_x) / GRID_CELL); cx <= (int)((x1 + reach - t->grid_x) / GRID_CELL); cx++) {
+      if (cx >= 0 && cy >= 0 && cx < t->grid_w && cy < t->grid_h) {
+        if (cells) cells[n] = cy * t->grid_w + cx;
+        n++;
+      }
+    }
+  }
+  return n;
+}
+
+void sim_track_end(sim_track *t) {
+  double x0 = 1e9, y0 = 1e9, x1 = -1e9, y1 = -1e9, margin = t->width + SENSOR_SPOT + GRID_CELL;
+  int item, i, ncells, total = 0, *fill, *cells;
+  for (item = -t->nbars; item < t->n; item++) {
+    double a, b, c, d;
+    if (item == 0) continue;
+    item_box(t, item, &a, &b, &c, &d);
+    x0 = fmin(x0, a);
+    y0 = fmin(y0, b);
+    x1 = fmax(x1, c);
+    y1 = fmax(y1, d);
+  }
+  t->grid_x = x0 - margin;
+  t->grid_y = y0 - margin;
+  t->grid_w = (int)((x1 - x0 + 2*margin) / GRID_CELL) + 1;
+  t->grid_h = (int)((y1 - y0 + 2*margin) / GRID_CELL) + 1;
+  ncells = t->grid_w * t->grid_h;
+  free(t->cell_start);
+  free(t->cell_items);
+  t->cell_start = calloc(ncells + 1, sizeof(int));
+  fill = calloc(ncells, sizeof(int));
+
+  // count the items of each cell, then file them
+  for (item = -t->nbars; item < t->n; item++) {
+    if (item == 0 || (item > 0 && t->gap[item])) continue;
+    total += item_cells(t, item, 0);
+  }
+  cells = malloc((total + 1) * sizeof(int));
+  t->cell_items = malloc((total + 1) * sizeof(int));
+  for (item = -t->nbars; item < t->n; item++) {
+    int n;
+    if (item == 0 || (item > 0 && t->gap[item])) continue;
+    n = item_cells(t, item, cells);
+    for (i = 0; i < n; i++) t->cell_start[cells[i] + 1]++;
+  }
+  for (i = 0; i < ncells; i++) t->cell_start[i + 1] += t->cell_start[i];
+  for (item = -t->nbars; item < t->n; item++) {
+    int n;
+    if (item == 0 || (item > 0 && t->gap[item])) continue;
+    n = item_cells(t, item, cells);
+    for (i = 0; i < n; i++) t->cell_items[t->cell_start[cells[i]] + fill[cells[i]]++] = item;
+  }
+  free(cells);
+  free(fill);
+}
+
+static int parse_error(const char *path, int line, const char *what) {
+  fprintf(stderr, "%s:%d: %s\n", path, line, what);
+  return -1;
+}
+
+int sim_track_load(sim_track *t, const char *path) {
+  char buf[256], cmd[32];
+  double a, b, c;
+  double width = 19;
+  int line = 0, started = 0, n;
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return -1;
+  }
+  while (fgets(buf, sizeof(buf), f)) {
+    char *hash = strchr(buf, '#');
+    line++;
+    if (hash) *hash = 0;
+    n = sscanf(buf, "%31s %lf %lf %lf", cmd, &a, &b, &c);
+    if (n < 1) continue;
+    n--; // numbers given
+    if (!strcmp(cmd, "width") && n == 1 && !started) {
+      width = a;
+    } else if (!strcmp(cmd, "start") && n == 3 && !started) {
+      sim_track_begin(t, a, b, c, width);
+      started = 1;
+    } else if (!started) {
+      fclose(f);
+      return parse_error(path, line, "expected 'width w' or 'start x y heading'");
+    } else if (!strcmp(cmd, "straight") && n == 1) {
+      sim_track_straight(t, a);
+    } else if (!strcmp(cmd, "arc") && n == 2) {
+      sim_track_arc(t, a, b);
+    } else if (!strcmp(cmd, "gap") && n == 1) {
+      sim_track_gap(t, a);
+    } else if (!strcmp(cmd, "bar") && n == 2) {
+      sim_track_bar(t, a, b);
+    } else if (!strcmp(cmd, "calibration") && n <= 1) {
+      sim_track_calibration(t, n ? a : 10);
+    } else {
+      fclose(f);
+      return parse_error(path, line, "unknown command or wrong number of values");
+    }
+  }
+  fclose(f);
+  if (!started || t->n < 2) return parse_error(path, line, "track has no pieces");
+  sim_track_end(t);
+  return 0;
+}
+
+// Distance from a point to the line and progress along it.
+// Each piece of the polyline is a rectangle with square ends,
+// so the tape ends squarely at the last point.
+// Only pieces first..last are searched.
+static void track_locate_range(const sim_track *t, double px, double py, int first, int last,
+                               double *dist, double *progress, int *piece) {
+  int i;
+  double best = 1e9;
+  double where = -1;
+  if (first < 1) first = 1;
+  if (last > t->n - 1) last = t->n - 1;
+  for (i = first; i <= last; i++) {
+    double dx = t->x[i] - t->x[i-1];
+    double dy = t->y[i] - t->y[i-1];
+    double len = t->s[i] - t->s[i-1];
+    double along = ((px - t->x[i-1])*dx + (py - t->y[i-1])*dy) / len;
+    double across = fabs((px - t->x[i-1])*dy - (py - t->y[i-1])*dx) / len;
+    double d = across;
+    if (along < 0) d = (i > 1) ? hypot(across, along) : 1e9;
+    if (along > len) d = (i < t->n - 1) ? hypot(across, along - len) : 1e9;
+    if (d < best) {
+      best = d;
+      where = t->s[i-1] + along;
+      *piece = i;
+    }
+  }
+  *dist = best;
+  *progress = where;
+}
+
+// True once a point is beyond the square end of the tape,
+// within a couple of line widths of its axis.
+static int track_past_end(const sim_track *t, double px, double py) {
+  int n = t->n - 1;
+  double dx = t->x[n] - t->x[n-1];
+  double dy = t->y[n] - t->y[n-1];
+  double len = t->s[n] - t->s[n-1];
+  double along = ((px - t->x[n])*dx + (py - t->y[n])*dy) / len;
+  double across = fabs((px - t->x[n])*dy - (py - t->y[n])*dx) / len;
+  return along > 0 && across < 2*t->width;
+}
+
+////////////////////////////////////////////////////////////////
+// Robot model
+
+static void sensor_point(int i, double *px, double *py) {
+  double lateral = (i - 2) * SENSOR_SPACING; // sensor 0 is the leftmost
+  double s = sin(robot.theta), c = cos(robot.theta);
+  *px = robot.x + SENSOR_AHEAD*s + lateral*c;
+  *py = robot.y + SENSOR_AHEAD*c - lateral*s;
+}
+
+// How far a point is inside the tape of a piece or cross mark, in mm
+// (negative outside). Pieces are joined round, but the tape ends
+// square at the ends of the line and at gaps.
+static double item_inside(const sim_track *t, int item, double px, double py) {
+  if (item > 0) {
+    int i = item;
+    double dx = t->x[i] - t->x[i-1];
+    double dy = t->y[i] - t->y[i-1];
+    double len = t->s[i] - t->s[i-1];
+    double along = ((px - t->x[i-1])*dx + (py - t->y[i-1])*dy) / len;
+    double across = fabs((px - t->x[i-1])*dy - (py - t->y[i-1])*dx) / len;
+    double inside = t->width/2 - across;
+    int square_start = (i == 1 || t->gap[i-1]);
+    int square_end = (i == t->n - 1 || t->gap[i+1]);
+    if (along < 0 && !square_start) return t->width/2 - hypot(across, along);
+    if (along > len && !square_end) return t->width/2 - hypot(across, along - len);
+    if (square_start && along < inside) inside = along;
+    if (square_end && len - along < inside) inside = len - along;
+    return inside;
+  } else {
+    const sim_bar *b = &t->bars[-1 - item];
+    double u = fabs((px - b->x)*b->ux + (py - b->y)*b->uy);
+    double v = fabs((px - b->x)*b->uy - (py - b->y)*b->ux);
+    return fmin(b->half_length - u, b->half_width - v);
+  }
+}
+
+// fraction of a spot at px,py covered by the tape
+static double track_coverage(const sim_track *t, double px, double py) {
+  int cx = (int)((px - t->grid_x) / GRID_CELL);
+  int cy = (int)((py - t->grid_y) / GRID_CELL);
+  int k, cell;
+  double inside = -1e9, c;
+  if (px < t->grid_x || py < t->grid_y || cx >= t->grid_w || cy >= t->grid_h) return 0;
+  cell = cy * t->grid_w + cx;
+  for (k = t->cell_start[cell]; k < t->cell_start[cell + 1]; k++) {
+    double d = item_inside(t, t->cell_items[k], px, py);
+    if (d > inside) inside = d;
+  }
+  c = inside / SENSOR_SPOT + 0.5;
+  return (c < 0) ? 0 : (c > 1) ? 1 : c;
+}
+
+static double sensor_coverage(int i) {
+  double px, py;
+  sensor_point(i, &px, &py);
+  return track_coverage(cfg.track, px, py);
+}
+
+// QTR-RC reading: the time the sensor capacitor takes to discharge
+// through the phototransistor, inversely proportional to the light it
+// gets: the emitter light reflected by the floor, scaled by the
+// sensor's own sensitivity, plus ambient light. Capped at the timeout.
+static double sensor_raw(int i, int emitters) {
+  double c = sensor_coverage(i);
+  double light = cfg.ambient + cfg.ambient_drift * now_ns / 60e9;
+  double raw;
+  if (emitters) light += sensor_gain[i] * (REFLECT_WHITE + (REFLECT_BLACK - REFLECT_WHITE) * c);
+  raw = (light > 0) ? RAW_SCALE / light : sensor_timeout;
+  raw += cfg.sensor_noise * (2*sim_random() - 1);
+  if (raw < 0) raw = 0;
+  if (raw > sensor_timeout) raw = sensor_timeout;
+  return raw;
+}
+
+// steady state wheel speed in mm/s for a motor command,
+// the linear fit measured on robot 493.
+static double wheel_speed(int cmd, double gain) {
+  double v = fabs((double)cmd) * 4.7682 - 33;
+  if (v < 0) v = 0;
+  return ((cmd < 0) ? -v : v) * gain;
+}
+
+static void robot_step(double dt) {
+  static double last_dt, al, ar;
+  double v, w;
+  if (dt != last_dt) { // steps mostly come in a couple of sizes
+    al = 1 - exp(-dt * 1000 / cfg.left_tau_ms);
+    ar = 1 - exp(-dt * 1000 / cfg.right_tau_ms);
+    last_dt = dt;
+  }
+  robot.vl += (wheel_speed(robot.cmd_l, cfg.left_gain) - robot.vl) * al;
+  robot.vr += (wheel_speed(robot.cmd_r, cfg.right_gain) - robot.vr) * ar;
+  v = (robot.vl + robot.vr) / 2;
+  w = (robot.vl - robot.vr) / cfg.wheel_base; // clockwise positive
+  robot.theta += w * dt / 2;
+  robot.x += v * dt * sin(robot.theta);
+  robot.y += v * dt * cos(robot.theta);
+  robot.theta += w * dt / 2;
+}
+
+// lap start: the sensor row has moved 10mm along the line;
+// lap end: the sensor row has passed the end of the tape.
+// The robot moves little between steps, so only the pieces
+// near the previous one are searched, and the whole track only
+// now and then while it is away from the line.
+static void track_lap() {
+  double px, py, dist, progress;
+  int seen;
+  if (lap_end_ms >= 0) return;
+  sensor_point(2, &px, &py);
+  track_locate_range(cfg.track, px, py, lap_piece - 4, lap_piece + 4, &dist, &progress, &lap_piece);
+  if (dist > cfg.track->width && now_ns >= next_full_search) {
+    next_full_search = now_ns + 20000000; // the robot may have cut across to another part
+    track_locate_range(cfg.track, px, py, 1, cfg.track->n - 1, &dist, &progress, &lap_piece);
+  }
+  if (lap_start_ms < 0) {
+    if (progress > start_progress + 10) lap_start_ms = now_ns / 1e6;
+    return;
+  }
+  if (track_past_end(cfg.track, px, py)) {
+    lap_end_ms = now_ns / 1e6;
+    return;
+  }
+  // the line is under the sensor row if it is within reach of the outer sensors
+  seen = dist < 2*SENSOR_SPACING + cfg.track->width/2;
+  if (!seen && !line_lost) line_losses++;
+  line_lost = !seen;
+}
+
+////////////////////////////////////////////////////////////////
+// Clock
+// Timers 0 and 2 overflow every 102.4us (20 MHz/8/256). Timer 2
+// drives millis() inside the Pololu library; timer 0 interrupts are
+// passed on to the firmware when it enables them.
+
+#define TIMER_TICK_NS 102400
+
+volatile uint8_t SREG;
+volatile uint8_t TCCR0A, TCCR0B, TCNT0, TIMSK0, TIFR0;
+
+// defined by the firmware with ISR(TIMER0_OVF_vect), if at all
+void sim_isr_timer0_ovf(void) __attribute__((weak));
+
+static int timer0_armed() {
+  return (SREG & 0x80) && (TIMSK0 & (1 << TOIE0)) && sim_isr_timer0_ovf;
+}
+
+// Interrupt handlers take no simulated time: while one runs, calls
+// that would advance the clock (get_ticks(), delay_us()) don't.
+static int in_isr;
+
+static void call_isr(void (*isr)(void)) {
+  SREG &= (uint8_t)~0x80; // interrupts are off inside an ISR
+  in_isr = 1;
+  isr();
+  in_isr = 0;
+  SREG |= 0x80;
+}
+
+static void timer_tick() {
+  if (timer0_armed()) call_isr(sim_isr_timer0_ovf);
+}
+
+// The robot model is integrated lazily, up to the current time,
+// whenever something observes or changes it.
+static void sync_robot() {
+  while (robot_ns < now_ns) {
+    unsigned long long step = now_ns - robot_ns;
+    if (step > PHYSICS_STEP_NS) step = PHYSICS_STEP_NS;
+    robot_step(step / 1e9);
+    robot_ns += step;
+  }
+}
+
+////////////////////////////////////////////////////////////////
+// USART0
+// The data register empty interrupt is raised while it is enabled
+// and the transmitter can take a byte; each byte then keeps the
+// line busy for 10 bit times and is appended to cfg.uart_out.
+
+volatile uint16_t UBRR0, UDR0;
+volatile uint8_t UCSR0A, UCSR0B, UCSR0C;
+
+void sim_isr_usart_udre(void) __attribute__((weak));
+
+static unsigned long long uart_free_ns; // when the transmitter can take a byte
+
+static int uart_armed() {
+  return (SREG & 0x80) && (UCSR0B & (1 << UDRIE0)) && (UCSR0B & (1 << TXEN0))
+    && sim_isr_usart_udre;
+}
+
+static void uart_service() {
+  while (uart_armed() && now_ns >= uart_free_ns) {
+    double baud = 20e6 / (((UCSR0A & (1 << U2X0)) ? 8 : 16) * (UBRR0 + 1.0));
+    UDR0 = 0x100;
+    call_isr(sim_isr_usart_udre);
+    if (UDR0 > 0xff) break; // the ISR had nothing to send
+    if (cfg.uart_out) fputc(UDR0, cfg.uart_out);
+    uart_free_ns = now_ns + (unsigned long long)(10e9 / baud);
+  }
+}
+
+////////////////////////////////////////////////////////////////
+// Port C
+// For firmware that times the QTR-RC sensors itself: a sensor pin
+// driven high charges the sensor, and once it is made an input it
+// reads high for as long as sensor_raw() ticks (with the emitters on
+// if PC5 is driven high at that moment), then falls. A fall on a pin
+// enabled in PCMSK1 raises the pin change interrupt, late if
+// interrupts are off. The registers are plain variables, so changes
+// are noticed at the next call into the simulator, which for the
+// firmware is the same moment.
+
+#define PORTC_SENSORS 0x1f
+#define PORTC_EMITTERS 0x20
+
+volatile uint8_t DDRC, PORTC, PINC;
+volatile uint8_t PCICR, PCIFR, PCMSK1;
+
+void sim_isr_pcint1(void) __attribute__((weak));
+
+static uint8_t sensor_charged;                 // capacitors charged
+static unsigned long long sensor_fall[SIM_SENSORS]; // when they discharge, 0 if not yet timed
+static unsigned long long next_fall;
+static int pcint_pending;
+static int port_c_synced;                      // nothing changed since the last port_c_sync()
+static uint8_t synced_ddrc, synced_portc, synced_charged;
+
+// Works out what the pins do from the registers, once per change of
+// them: a discharge is timed when it starts, and until a pin falls
+// or the firmware writes the port there is nothing to do.
+static void port_c_sync() {
+  int i;
+  int emitters = (DDRC & PORTC & PORTC_EMITTERS) != 0;
+  if (port_c_synced && DDRC == synced_ddrc && PORTC == synced_portc && sensor_charged == synced_charged) return;
+  next_fall = ~0ULL;
+  for (i = 0; i < SIM_SENSORS; i++) {
+    uint8_t bit = 1 << i;
+    if (DDRC & bit) {
+      sensor_fall[i] = 0;
+      if (PORTC & bit) sensor_charged |= bit; else sensor_charged &= ~bit;
+    } else if ((sensor_charged & bit) && !sensor_fall[i]) {
+      sync_robot();
+      sensor_fall[i] = now_ns + (unsigned long long)(sensor_raw(i, emitters) * COST_TICK_US * 1000) + 1;
+    }
+    if (sensor_fall[i] && sensor_fall[i] < next_fall) next_fall = sensor_fall[i];
+  }
+  PINC = (PINC & ~PORTC_SENSORS) | (((DDRC & PORTC) | (~DDRC & sensor_charged)) & PORTC_SENSORS);
+  synced_ddrc = DDRC;
+  synced_portc = PORTC;
+  synced_charged = sensor_charged;
+  port_c_synced = 1;
+}
+
+static void port_c_service() {
+  int i;
+  port_c_sync();
+  if (next_fall > now_ns && !pcint_pending) return;
+  for (i = 0; i < SIM_SENSORS; i++) {
+    uint8_t bit = 1 << i;
+    if (sensor_fall[i] && sensor_fall[i] <= now_ns) {
+      sensor_fall[i] = 0;
+      sensor_charged &= ~bit;
+      if (PCMSK1 & bit) pcint_pending = 1;
+    }
+  }
+  port_c_sync();
+  if (pcint_pending && (PCICR & (1 << PCIE1)) && (SREG & 0x80) && sim_isr_pcint1) {
+    pcint_pending = 0;
+    call_isr(sim_isr_pcint1);
+    port_c_sync();
+  }
+}
+
+void sim_advance_us(double us) {
+  unsigned long long end = now_ns + (unsigned long long)(us * 1000 + 0.5);
+  if (replaying) return;
+  if (in_isr) {
+    port_c_sync(); // no time passes, but the pins may have changed
+    return;
+  }
+  port_c_service();
+  while (now_ns < end) {
+    unsigned long long step_end = end;
+    if (step_end > next_fall) step_end = next_fall;
+    if (step_end > next_tick && timer0_armed()) step_end = next_tick;
+    if (step_end > next_lap_check) step_end = next_lap_check;
+    if (step_end > uart_free_ns && now_ns < uart_free_ns && uart_armed()) step_end = uart_free_ns;
+    uart_service();
+    now_ns = step_end;
+    TCNT0 = (uint8_t)(now_ns % TIMER_TICK_NS / 400); // counts 8 cycles, 0.4 us
+    if (now_ns >= next_tick) {
+      // ticks skipped while the interrupt was off don't fire late
+      int on_tick = (now_ns == next_tick);
+      next_tick = (now_ns / TIMER_TICK_NS + 1) * TIMER_TICK_NS;
+      if (on_tick) timer_tick();
+    }
+    uart_service();
+    port_c_service();
+    if (now_ns >= next_lap_check) {
+      sync_robot();
+      track_lap();
+      next_lap_check = now_ns + LAP_CHECK_NS;
+      if (now_ns > limit_ns) sim_finish(SIM_TIMEOUT);
+    }
+  }
+}
+
+// sleep_cpu(): idle until the next timer interrupt
+void sim_sleep() {
+  if (next_tick <= now_ns) next_tick = (now_ns / TIMER_TICK_NS + 1) * TIMER_TICK_NS;
+  sim_advance_us((next_tick - now_ns) / 1000.0);
+}
+
+double sim_now_ms() {
+  return now_ns / 1e6;
+}
+
+void sim_replay_begin() {
+  replaying = 1;
+}
+
+void sim_replay_set(unsigned long ticks, unsigned char buttons, int battery_mv) {
+  now_ns = (unsigned long long)ticks * (unsigned long long)(COST_TICK_US * 1000);
+  replay_buttons = buttons;
+  replay_mv = battery_mv;
+}
+
+const sim_robot *sim_robot_state() {
+  sync_robot();
+  return &robot;
+}
+
+void sim_config_default(sim_config *c) {
+  static sim_track track;
+  memset(c, 0, sizeof(*c));
+  if (track.n == 0) sim_track_default(&track);
+  c->seed = 1;
+  c->time_limit_ms = 120000;
+  c->npresses = 2;
+  c->presses[0].buttons = BUTTON_B; // leave the welcome screen, calibrate
+  c->presses[0].at_ms = 200;
+  c->presses[0].hold_ms = 100;
+  c->presses[1].buttons = BUTTON_B; // start running
+  c->presses[1].at_ms = 3200;
+  c->presses[1].hold_ms = 100;
+  c->sensor_noise = 20;
+  c->ambient = 0.005;
+  c->sensor_spread = 0.05;
+  c->left_tau_ms = 60;
+  c->right_tau_ms = 60;
+  c->left_gain = 1;
+  c->right_gain = 1;
+  c->wheel_base = 82; // robot_width = 820
+  c->track = &track;
+}
+
+void sim_init(const sim_config *c) {
+  double px, py, dist;
+  int i;
+  cfg = *c;
+  memset(&robot, 0, sizeof(robot));
+  now_ns = 0;
+  next_lap_check = 0;
+  next_full_search = 0;
+  next_tick = TIMER_TICK_NS;
+  limit_ns = (unsigned long long)(cfg.time_limit_ms * 1e6);
+  robot_ns = 0;
+  SREG = 0;
+  TIMSK0 = 0;
+  UCSR0B = 0;
+  uart_free_ns = 0;
+  DDRC = PORTC = PINC = 0;
+  port_c_synced = 0;
+  PCICR = PCIFR = PCMSK1 = 0;
+  sensor_charged = 0;
+  memset(sensor_fall, 0, sizeof(sensor_fall));
+  next_fall = ~0ULL;
+  pcint_pending = 0;
+  in_isr = 0;
+  replaying = 0;
+  memset(eeprom, 0xff, sizeof(eeprom));
+  eeprom_dirty = 0;
+  if (cfg.eeprom_file) {
+    FILE *f = fopen(cfg.eeprom_file, "rb");
+    if (f) {
+      if (fread(eeprom, 1, sizeof(eeprom), f) == 0) memset(eeprom, 0xff, sizeof(eeprom));
+      fclose(f);
+    }
+  }
+  rng = cfg.seed * 2654435761UL + 1;
+  if (!cfg.track->cell_start) sim_track_end((sim_track *)cfg.track);
+  for (i = 0; i < SIM_SENSORS; i++) sensor_gain[i] = 1 + cfg.sensor_spread * (2*sim_random() - 1);
+  memset(lcd, ' ', sizeof(lcd));
+  lcd[0][8] = lcd[1][8] = 0;
+  lcd_x = lcd_y = 0;
+  lap_start_ms = lap_end_ms = -1;
+  line_lost = 0;
+  line_losses = 0;
+  sensor_point(2, &px, &py);
+  track_locate_range(cfg.track, px, py, 1, cfg.track->n - 1, &dist, &start_progress, &lap_piece);
+}
+
+void sim_finish(int status) {
+  sim_result r;
+  sync_robot();
+  r.status = status;
+  r.sim_ms = now_ns / 1e6;
+  r.lap_ms = (lap_start_ms >= 0 && lap_end_ms >= 0) ? lap_end_ms - lap_start_ms : -1;
+  r.line_losses = line_losses;
+  r.x = robot.x;
+  r.y = robot.y;
+  r.theta_deg = robot.theta * 180 / PI;
+  r.home_err = hypot(robot.x, robot.y);
+  if (cfg.eeprom_file && eeprom_dirty) {
+    FILE *f = fopen(cfg.eeprom_file, "wb");
+    if (!f || fwrite(eeprom, 1, sizeof(eeprom), f) != sizeof(eeprom)) perror(cfg.eeprom_file);
+    if (f) fclose(f);
+  }
+  cfg.finish(&r);
+  exit(1); // finish must not return
+}
+
+const char *sim_lcd_row(int row) {
+  return lcd[row & 1];
+}
+
+////////////////////////////////////////////////////////////////
+// pololu/3pi.h stand-in
+
+void pololu_3pi_init(unsigned int line_sensor_timeout) {
+  sensor_timeout = line_sensor_timeout;
+  SREG |= 0x80; // the library runs its timers from interrupts
+  sim_advance_us(COST_INIT);
+}
+
+void read_line_sensors(unsigned int *sensor_values, unsigned char read_mode) {
+  int i;
+  double longest = 0;
+  sync_robot();
+  for (i = 0; i < SIM_SENSORS; i++) {
+    double raw = sensor_raw(i, read_mode != IR_EMITTERS_OFF);
+    sensor_values[i] = (unsigned int)raw;
+    if (raw > longest) longest = raw;
+  }
+  // the read lasts until the slowest sensor has discharged
+  sim_advance_us((read_mode != IR_EMITTERS_OFF ? COST_EMITTERS : 0) + longest * COST_TICK_US);
+}
+
+void emitters_on() { sim_advance_us(COST_CALL); }
+void emitters_off() { sim_advance_us(COST_CALL); }
+
+static int clamp_motor(int m) {
+  return (m > 255) ? 255 : (m < -255) ? -255 : m;
+}
+
+void set_motors(int left, int right) {
+  sync_robot();
+  robot.cmd_l = clamp_motor(left);
+  robot.cmd_r = clamp_motor(right);
+  sim_advance_us(COST_CALL);
+}
+
+// ten ADC conversions averaged, reads to within a few mV of a fresh
+// pack; the motors run off the boost regulator and don't follow it
+int read_battery_millivolts() {
+  double mv;
+  if (replaying) return replay_mv;
+  mv = 5000 + 4 * (2*sim_random() - 1);
+  sim_advance_us(10 * 104);
+  return (int)(mv + 0.5);
+}
+
+unsigned long millis() {
+  sim_advance_us(COST_CALL);
+  return (unsigned long)(now_ns / 1e6);
+}
+
+unsigned long get_ticks() {
+  sim_advance_us(COST_CALL);
+  return (unsigned long)(now_ns / (COST_TICK_US * 1000));
+}
+
+unsigned long ticks_to_microseconds(unsigned long ticks) {
+  return ticks * 2 / 5;
+}
+
+void delay_ms(unsigned int milliseconds) {
+  sim_advance_us(milliseconds * 1000.0);
+}
+
+void delay_us(unsigned int microseconds) {
+  sim_advance_us(microseconds);
+}
+
+// addresses are offsets into the EEPROM, out of range ones wrap
+void eeprom_read_block(void *dst, const void *src, size_t n) {
+  size_t a = (size_t)src, i;
+  for (i = 0; i < n; i++) ((unsigned char *)dst)[i] = eeprom[(a + i) & E2END];
+  sim_advance_us(COST_CALL);
+}
+
+void eeprom_update_block(const void *src, void *dst, size_t n) {
+  size_t a = (size_t)dst, i;
+  for (i = 0; i < n; i++) {
+    unsigned char b = ((const unsigned char *)src)[i];
+    if (eeprom[(a + i) & E2END] == b) continue;
+    eeprom[(a + i) & E2END] = b;
+    eeprom_dirty = 1;
+    sim_advance_us(COST_EEPROM_WRITE);
+  }
+}
+
+unsigned char button_is_pressed(unsigned char buttons) {
+  int i;
+  unsigned char down = 0;
+  double t = now_ns / 1e6;
+  if (replaying) return replay_buttons & buttons;
+  for (i = 0; i < cfg.npresses; i++) {
+    const sim_press *p = &cfg.presses[i];
+    if (t >= p->at_ms && t < p->at_ms + p->hold_ms) down |= p->buttons;
+  }
+  sim_advance_us(COST_CALL);
+  return down & buttons;
+}
+
+unsigned char wait_for_button_press(unsigned char buttons) {
+  unsigned char b;
+  while (!(b = button_is_pressed(buttons))) sim_advance_us(1000);
+  return b;
+}
+
+unsigned char wait_for_button_release(unsigned char buttons) {
+  unsigned char b = button_is_pressed(buttons);
+  while (button_is_pressed(buttons)) sim_advance_us(1000);
+  return b;
+}
+
+unsigned char wait_for_button(unsigned char buttons) {
+  unsigned char b = wait_for_button_press(buttons);
+  wait_for_button_release(b);
+  return b;
+}
+
+void clear() {
+  memset(lcd, ' ', sizeof(lcd));
+  lcd[0][8] = lcd[1][8] = 0;
+  lcd_x = lcd_y = 0;
+  sim_advance_us(COST_LCD_CLEAR);
+}
+
+void print_character(char c) {
+  if (lcd_x < 8) lcd[lcd_y][lcd_x] = c;
+  lcd_x++;
+  sim_advance_us(COST_LCD_CHAR);
+}
+
+void print(const char *str) {
+  while (*str) print_character(*str++);
+}
+
+void print_from_program_space(const char *str) {
+  print(str);
+}
+
+void print_long(long value) {
+  char buf[24];
+  sprintf(buf, "%ld", value);
+  print(buf);
+}
+
+void print_unsigned_long(unsigned long value) {
+  char buf[24];
+  sprintf(buf, "%lu", value);
+  print(buf);
+}
+
+void lcd_goto_xy(int col, int row) {
+  lcd_x = col;
+  lcd_y = row & 1;
+  sim_advance_us(COST_LCD_CHAR);
+}
+
+void lcd_load_custom_character(const char *picture, unsigned char number) {
+  (void)picture;
+  (void)number;
+  sim_advance_us(COST_LCD_CUSTOM);
+}
+
+// the buzzer plays from interrupts on the robot, so starting a tune is cheap
+void play(const char *notes) {
+  (void)notes;
+  sim_advance_us(COST_CALL);
+}
+
+void play_from_program_space(const char *notes) {
+  play(notes);
+}
+
+unsigned char is_playing() {
+  return 0;
+}
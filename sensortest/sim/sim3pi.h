@@ -0,0 +1,137 @@
+// Host-side 3pi simulator.
+// Implements the pololu/3pi.h stand-in on top of a differential
+// drive model driving over a virtual track, with a simulated clock
+// that only moves when the firmware calls something that takes time
+// on the robot. Runs the unchanged control code much faster than
+// real time.
+//
+// World frame matches the odometry in dead.c: the robot boots at
+// the origin facing +y, x grows to the right, and the heading is
+// measured clockwise from +y (like the heading of a boat).
+// Distances are in mm, headings in radians.
+#ifndef SIM3PI_H
+#define SIM3PI_H
+
+#include <stdio.h>
+
+#define SIM_SENSORS 5
+#define SIM_MAX_POINTS 2048
+#define SIM_MAX_PRESSES 16
+#define SIM_MAX_BARS 32
+
+// A cross mark: a strip of tape of the given length and width,
+// centred on a point of the line and square to it.
+typedef struct {
+  double x, y;              // center
+  double ux, uy;            // unit vector along the strip
+  double half_length, half_width;
+} sim_bar;
+
+// A track is a tape line given as a polyline of center points.
+// Pieces can be left bare (gaps), and cross marks added on top.
+// Sensor lookups go through a grid of cells listing the pieces and
+// marks within reach, built by sim_track_end().
+typedef struct {
+  int n;
+  double x[SIM_MAX_POINTS];
+  double y[SIM_MAX_POINTS];
+  double s[SIM_MAX_POINTS]; // arc length from the first point
+  unsigned char gap[SIM_MAX_POINTS]; // no tape on the piece ending at this point
+  double width;             // line width
+  double heading;           // heading of the last piece, used while building
+  int nbars;
+  sim_bar bars[SIM_MAX_BARS];
+  // lookup grid
+  double grid_x, grid_y;    // lower left corner
+  int grid_w, grid_h;
+  int *cell_start;          // items of cell c are cell_items[cell_start[c]..cell_start[c+1]-1]
+  int *cell_items;          // piece number, or -1-bar for a cross mark
+} sim_track;
+
+// t must be zeroed (static) or hold a track already, which is freed
+void sim_track_begin(sim_track *t, double x, double y, double heading, double width);
+void sim_track_straight(sim_track *t, double length);
+// positive degrees turn right (clockwise)
+void sim_track_arc(sim_track *t, double radius, double degrees);
+// a straight stretch without tape
+void sim_track_gap(sim_track *t, double length);
+// a cross mark centred on the end of the line so far
+void sim_track_bar(sim_track *t, double length, double width);
+// the speed calibration marks of speed_calibrate(): two gaps of the given
+// length whose leading edges are 200 mm apart, with 100 mm of line
+// before and after
+void sim_track_calibration(sim_track *t, double gap);
+// builds the lookup grid, must be called once the track is complete
+void sim_track_end(sim_track *t);
+double sim_track_length(const sim_track *t);
+void sim_track_default(sim_track *t);
+// Reads a track file, see sim/tracks/default.trk for the format.
+// Returns 0, or -1 after printing what is wrong.
+int sim_track_load(sim_track *t, const char *path);
+
+// A scripted button press: buttons held from at_ms for hold_ms.
+typedef struct {
+  unsigned char buttons;
+  double at_ms;
+  double hold_ms;
+} sim_press;
+
+typedef struct sim_result sim_result;
+
+typedef struct {
+  unsigned long seed;
+  double time_limit_ms;     // give up after this much simulated time
+  int npresses;
+  sim_press presses[SIM_MAX_PRESSES];
+  double sensor_noise;      // raw units, uniform +/-
+  double ambient;           // ambient light, relative to the emitters over white
+  double ambient_drift;     // and how much it rises per minute of simulated time
+  double sensor_spread;     // sensor to sensor sensitivity spread, +/- fraction
+  double left_tau_ms;       // first-order motor/wheel time constants
+  double right_tau_ms;
+  double left_gain;         // multiplicative wheel speed errors
+  double right_gain;
+  double wheel_base;        // mm between the wheels' contact points
+  const sim_track *track;
+  FILE *uart_out;           // receives what the firmware sends on the serial port
+  const char *eeprom_file;  // EEPROM image kept between trials, or 0 for a blank one
+  void (*finish)(const sim_result *r); // called once, must not return
+} sim_config;
+
+enum { SIM_RETURNED = 1, SIM_TIMEOUT = 2 };
+
+struct sim_result {
+  int status;
+  double sim_ms;
+  double lap_ms;            // time from leaving the start to crossing the end, <0 if never
+  int line_losses;          // times no sensor saw the line during the lap
+  double x, y, theta_deg;   // final pose
+  double home_err;          // distance from the boot location at the end
+};
+
+typedef struct {
+  double x, y, theta;       // axle center pose
+  double vl, vr;            // wheel speeds, mm/s
+  int cmd_l, cmd_r;         // last motor commands
+} sim_robot;
+
+void sim_init(const sim_config *cfg);
+void sim_advance_us(double us);
+double sim_now_ms(void);
+const sim_robot *sim_robot_state(void);
+void sim_finish(int status);
+
+// default configuration: stock robot on the default track,
+// B pressed once to calibrate and once to start running.
+void sim_config_default(sim_config *cfg);
+
+// LCD contents, two rows of 8 characters.
+const char *sim_lcd_row(int row);
+
+// Replay mode, for sim/replay.c: the clock stands still but for
+// sim_replay_set(), which also gives what the buttons and the battery
+// read until the next one. The robot model and the track are left out.
+void sim_replay_begin(void);
+void sim_replay_set(unsigned long ticks, unsigned char buttons, int battery_mv);
+
+#endif
@@ -0,0 +1,173 @@
+// Runs the unchanged dead.c main() against the simulator.
+// Each trial is a forked child so the firmware globals start
+// fresh, and a crash or hang in one trial doesn't end the others.
+//
+// usage: simrun [-n trials] [-s first_seed] [-t time_limit_ms]
+//               [-b buttons:at_ms:hold_ms,...] [-g left_gain:right_gain] [-w wheel_base_mm]
+//               [-T left_tau_ms:right_tau_ms]
+//               [-o serial_capture] [-f track_file] [-a ambient[:per_min]]
+//               [-e eeprom_image] [-v] [-h]
+// With -o, what the firmware sends on the serial port is saved to
+// the given file, or to file.<seed> when running several trials.
+// With -e, the EEPROM starts from the image file (blank if there is
+// none) and what the firmware writes is saved back to it, so a
+// later run boots with the calibration an earlier one saved.
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <pololu/3pi.h>
+#include "sim3pi.h"
+
+int dead_main(); // main() of dead.c, renamed when building for the host
+
+static int result_fd;
+static int verbose;
+static const char *uart_file;
+static int trials = 1;
+static FILE *uart_file_out;
+
+static void send_result(const sim_result *r) {
+  if (verbose) {
+    fprintf(stderr, "lcd: [%s]\n     [%s]\n", sim_lcd_row(0), sim_lcd_row(1));
+  }
+  if (uart_file) fflush(uart_file_out);
+  if (write(result_fd, r, sizeof(*r)) != sizeof(*r)) _exit(2);
+  _exit(0);
+}
+
+static double wall_ms() {
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+// run one trial in a child process, returns 0 if it produced a result
+static int run_trial(const sim_config *cfg, sim_result *r) {
+  int fds[2], status, got;
+  pid_t pid;
+  if (pipe(fds)) return -1;
+  fflush(stdout); // or the child repeats whatever is still buffered
+  pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    result_fd = fds[1];
+    alarm(60); // wall clock guard against firmware loops that never take time
+    if (uart_file) {
+      sim_config c = *cfg;
+      char name[512];
+      if (trials > 1) snprintf(name, sizeof(name), "%s.%lu", uart_file, cfg->seed);
+      else snprintf(name, sizeof(name), "%s", uart_file);
+      c.uart_out = uart_file_out = fopen(name, "wb");
+      if (!c.uart_out) perror(name);
+      sim_init(&c);
+    } else {
+      sim_init(cfg);
+    }
+    dead_main();
+    sim_finish(SIM_RETURNED);
+  }
+  close(fds[1]);
+  got = read(fds[0], r, sizeof(*r)) == sizeof(*r);
+  close(fds[0]);
+  waitpid(pid, &status, 0);
+  if (WIFSIGNALED(status)) {
+    fprintf(stderr, "seed %lu: firmware died with signal %d\n", cfg->seed, WTERMSIG(status));
+    return -1;
+  }
+  return (got && WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+static unsigned char parse_buttons(const char *s) {
+  unsigned char b = 0;
+  for (; *s && *s != ':'; s++) {
+    if (*s == 'A') b |= BUTTON_A;
+    if (*s == 'B') b |= BUTTON_B;
+    if (*s == 'C') b |= BUTTON_C;
+  }
+  return b;
+}
+
+static void parse_presses(sim_config *cfg, char *arg) {
+  char *tok;
+  cfg->npresses = 0;
+  for (tok = strtok(arg, ","); tok && cfg->npresses < SIM_MAX_PRESSES; tok = strtok(0, ",")) {
+    sim_press *p = &cfg->presses[cfg->npresses++];
+    p->buttons = parse_buttons(tok);
+    p->at_ms = 0;
+    p->hold_ms = 100;
+    sscanf(strchr(tok, ':') ? strchr(tok, ':') + 1 : "", "%lf:%lf", &p->at_ms, &p->hold_ms);
+  }
+}
+
+int main(int argc, char **argv) {
+  static sim_track track;
+  sim_config cfg;
+  int opt, i, done = 0, laps = 0;
+  double lap_sum = 0, home_sum = 0, home_max = 0, loss_sum = 0, sim_sum = 0;
+  double start;
+
+  sim_config_default(&cfg);
+  cfg.finish = send_result;
+  while ((opt = getopt(argc, argv, "n:s:t:b:g:w:T:o:f:a:e:vh")) != -1) {
+    switch (opt) {
+    case 'n': trials = atoi(optarg); break;
+    case 's': cfg.seed = strtoul(optarg, 0, 0); break;
+    case 't': cfg.time_limit_ms = atof(optarg); break;
+    case 'b': parse_presses(&cfg, optarg); break;
+    case 'g': sscanf(optarg, "%lf:%lf", &cfg.left_gain, &cfg.right_gain); break;
+    case 'w': cfg.wheel_base = atof(optarg); break;
+    case 'T': sscanf(optarg, "%lf:%lf", &cfg.left_tau_ms, &cfg.right_tau_ms); break;
+    case 'o': uart_file = optarg; break;
+    case 'f':
+      if (sim_track_load(&track, optarg)) return 1;
+      cfg.track = &track;
+      break;
+    case 'a': sscanf(optarg, "%lf:%lf", &cfg.ambient, &cfg.ambient_drift); break;
+    case 'e': cfg.eeprom_file = optarg; break;
+    case 'v': verbose = 1; break;
+    default:
+      fprintf(stderr, "usage: %s [-n trials] [-s seed] [-t limit_ms] "
+              "[-b buttons:at_ms:hold_ms,...] [-g left:right] [-w wheel_base_mm] [-T tau_ms:tau_ms] [-o capture] "
+              "[-f track] [-a ambient[:per_min]] [-e eeprom] [-v] [-h]\n", argv[0]);
+      return opt != 'h';
+    }
+  }
+
+  printf("%6s %6s %9s %5s %9s %9s %8s %9s\n",
+         "seed", "status", "lap_ms", "lost", "x_mm", "y_mm", "home_mm", "sim_ms");
+  start = wall_ms();
+  for (i = 0; i < trials; i++) {
+    sim_result r;
+    if (run_trial(&cfg, &r) == 0) {
+      printf("%6lu %6s %9.0f %5d %9.1f %9.1f %8.1f %9.0f\n", cfg.seed,
+             r.status == SIM_RETURNED ? "home" : "limit",
+             r.lap_ms, r.line_losses, r.x, r.y, r.home_err, r.sim_ms);
+      done++;
+      sim_sum += r.sim_ms;
+      loss_sum += r.line_losses;
+      home_sum += r.home_err;
+      if (r.home_err > home_max) home_max = r.home_err;
+      if (r.lap_ms >= 0) {
+        laps++;
+        lap_sum += r.lap_ms;
+      }
+    }
+    cfg.seed++;
+  }
+
+  if (done) {
+    double wall = wall_ms() - start;
+    printf("trials %d/%d  laps %d  mean lap %.0f ms  mean losses %.2f  "
+           "home error mean %.1f max %.1f mm\n",
+           done, trials, laps, laps ? lap_sum / laps : -1.0, loss_sum / done,
+           home_sum / done, home_max);
+    printf("simulated %.1f s in %.2f s wall clock (%.0fx real time)\n",
+           sim_sum / 1000, wall / 1000, wall > 0 ? sim_sum / wall : 0.0);
+  }
+  return done == trials ? 0 : 1;
+}
@@ -0,0 +1,372 @@
+// Offline parameter search for dead.c against the simulator.
+// Runs the unchanged firmware with different base speeds, off-line
+// thresholds and PID gains, spreading the trials over all CPU cores
+// (one forked child per trial, like simrun), ranks the parameter
+// sets and writes the best one as a params.h to flash.
+//
+// usage: sweep [-n seeds] [-s first_seed] [-j jobs] [-t limit_ms]
+//              [-e generations] [-P population] [-w lap:loss:home]
+//              [-f track_file] [-o params.h] -p name=lo:hi[:step] ...
+// Parameters: speed, threshold, kp, ki, kd (the gains of the speed
+// band the base speed falls in, see pid.h). Those not given with -p
+// keep the values built into dead.c.
+// Without -e every combination on the lo:hi:step grid is tried. With
+// -e a population is evolved for that many generations: the best
+// quarter is kept and mutated within lo:hi to make the rest.
+// Each set runs on -n seeds and scores the mean of
+//   lap seconds + loss weight * line losses + home weight * homing mm
+// plus 100 for each trial that doesn't make it home.
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <pololu/3pi.h>
+#include "sim3pi.h"
+
+int dead_main(); // main() of dead.c, renamed when building for the host
+
+// the tunable globals of dead.c and pid.h
+typedef struct { int kp, ki, kd; } gains;
+extern int rotation;
+extern unsigned char line_threshold_pct;
+extern gains pid_band_gains[];
+extern const int pid_band_speed[];
+unsigned char pid_band(int speed);
+#define BANDS 4
+
+enum { P_SPEED, P_THRESHOLD, P_KP, P_KI, P_KD, NPARAMS };
+
+typedef struct {
+  const char *name;
+  int on;
+  int lo, hi, step;
+} param;
+
+static param params[NPARAMS] = {
+  {"speed"}, {"threshold"}, {"kp"}, {"ki"}, {"kd"},
+};
+
+typedef struct {
+  int v[NPARAMS];
+  double score, lap_ms, losses, home_mm;
+  int trials, failed;
+} candidate;
+
+#define FAIL_PENALTY 100
+
+static double w_lap = 1, w_loss = 2, w_home = 0.02;
+static int seeds = 3, jobs;
+static sim_config base_cfg;
+static int result_fd;
+
+static void send_result(const sim_result *r) {
+  if (write(result_fd, r, sizeof(*r)) != sizeof(*r)) _exit(2);
+  _exit(0);
+}
+
+// the firmware defaults, from the globals as dead.c initialises them
+static void defaults(candidate *c) {
+  int b = pid_band(rotation);
+  c->v[P_SPEED] = rotation;
+  c->v[P_THRESHOLD] = line_threshold_pct;
+  c->v[P_KP] = pid_band_gains[b].kp;
+  c->v[P_KI] = pid_band_gains[b].ki;
+  c->v[P_KD] = pid_band_gains[b].kd;
+}
+
+// Fills in the parameters that aren't searched. Gains follow the
+// band of the base speed unless they are searched too.
+static void complete(candidate *c) {
+  int b;
+  candidate d;
+  defaults(&d);
+  if (!params[P_SPEED].on) c->v[P_SPEED] = d.v[P_SPEED];
+  if (!params[P_THRESHOLD].on) c->v[P_THRESHOLD] = d.v[P_THRESHOLD];
+  b = pid_band(c->v[P_SPEED]);
+  if (!params[P_KP].on) c->v[P_KP] = pid_band_gains[b].kp;
+  if (!params[P_KI].on) c->v[P_KI] = pid_band_gains[b].ki;
+  if (!params[P_KD].on) c->v[P_KD] = pid_band_gains[b].kd;
+  c->trials = c->failed = 0;
+  c->lap_ms = c->losses = c->home_mm = 0;
+}
+
+static void apply(const candidate *c) {
+  int b = pid_band(c->v[P_SPEED]);
+  rotation = c->v[P_SPEED];
+  line_threshold_pct = c->v[P_THRESHOLD];
+  pid_band_gains[b].kp = c->v[P_KP];
+  pid_band_gains[b].ki = c->v[P_KI];
+  pid_band_gains[b].kd = c->v[P_KD];
+}
+
+// Runs every candidate on every seed, jobs trials at a time.
+static void evaluate(candidate *cands, int n) {
+  struct { pid_t pid; int fd, job; } running[256];
+  int next = 0, nrunning = 0, total = n * seeds, i;
+
+  while (next < total || nrunning) {
+    while (nrunning < jobs && next < total) {
+      int fds[2];
+      pid_t pid;
+      if (pipe(fds)) {
+        perror("pipe");
+        exit(1);
+      }
+      pid = fork();
+      if (pid == 0) {
+        sim_config cfg = base_cfg;
+        close(fds[0]);
+        result_fd = fds[1];
+        alarm(60);
+        cfg.seed += next % seeds;
+        apply(&cands[next / seeds]);
+        sim_init(&cfg);
+        dead_main();
+        sim_finish(SIM_RETURNED);
+      }
+      close(fds[1]);
+      running[nrunning].pid = pid;
+      running[nrunning].fd = fds[0];
+      running[nrunning].job = next++;
+      nrunning++;
+    }
+
+    {
+      int status;
+      pid_t pid = waitpid(-1, &status, 0);
+      for (i = 0; i < nrunning && running[i].pid != pid; i++) {}
+      if (i == nrunning) continue;
+      {
+        candidate *c = &cands[running[i].job / seeds];
+        sim_result r;
+        int got = read(running[i].fd, &r, sizeof(r)) == sizeof(r);
+        close(running[i].fd);
+        c->trials++;
+        if (got && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+            r.status == SIM_RETURNED && r.lap_ms >= 0) {
+          c->lap_ms += r.lap_ms;
+          c->losses += r.line_losses;
+          c->home_mm += r.home_err;
+        } else {
+          c->failed++;
+        }
+        running[i] = running[--nrunning];
+      }
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    candidate *c = &cands[i];
+    int ok = c->trials - c->failed;
+    if (ok > 0) {
+      c->lap_ms /= ok;
+      c->losses /= ok;
+      c->home_mm /= ok;
+      c->score = w_lap * c->lap_ms / 1000 + w_loss * c->losses + w_home * c->home_mm;
+    } else {
+      c->score = 0;
+    }
+    c->score += FAIL_PENALTY * (double)c->failed / c->trials;
+  }
+}
+
+static int by_score(const void *a, const void *b) {
+  double d = ((const candidate *)a)->score - ((const candidate *)b)->score;
+  return (d > 0) - (d < 0);
+}
+
+// grid: the candidate number i, counting through every combination
+static int grid_size() {
+  int i, n = 1;
+  for (i = 0; i < NPARAMS; i++) {
+    if (params[i].on) n *= (params[i].hi - params[i].lo) / params[i].step + 1;
+  }
+  return n;
+}
+
+static void grid_point(int k, candidate *c) {
+  int i;
+  for (i = 0; i < NPARAMS; i++) {
+    if (!params[i].on) continue;
+    {
+      int steps = (params[i].hi - params[i].lo) / params[i].step + 1;
+      c->v[i] = params[i].lo + (k % steps) * params[i].step;
+      k /= steps;
+    }
+  }
+  complete(c);
+}
+
+static int clamp_param(int i, int v) {
+  if (v < params[i].lo) return params[i].lo;
+  if (v > params[i].hi) return params[i].hi;
+  return v;
+}
+
+static void random_point(candidate *c) {
+  int i;
+  for (i = 0; i < NPARAMS; i++) {
+    if (params[i].on) {
+      int steps = (params[i].hi - params[i].lo) / params[i].step + 1;
+      c->v[i] = params[i].lo + (int)(drand48() * steps) * params[i].step;
+    }
+  }
+  complete(c);
+}
+
+// parent copy with each searched parameter moved by up to spread
+// of its range, in multiples of its step
+static void mutate(const candidate *parent, candidate *c, double spread) {
+  int i;
+  *c = *parent;
+  for (i = 0; i < NPARAMS; i++) {
+    if (params[i].on) {
+      double range = params[i].hi - params[i].lo;
+      double d = (drand48() * 2 - 1) * spread * range;
+      c->v[i] = clamp_param(i, c->v[i] + (int)floor(d / params[i].step + 0.5) * params[i].step);
+    }
+  }
+  complete(c);
+}
+
+static void print_candidate(FILE *f, int rank, const candidate *c) {
+  fprintf(f, "%4d %8.2f %8.0f %6.2f %8.1f %4d/%-3d %6d %5d %5d %5d %5d\n", rank, c->score,
+          c->lap_ms, c->losses, c->home_mm, c->trials - c->failed, c->trials,
+          c->v[P_SPEED], c->v[P_THRESHOLD], c->v[P_KP], c->v[P_KI], c->v[P_KD]);
+}
+
+static void print_header(FILE *f) {
+  fprintf(f, "%4s %8s %8s %6s %8s %8s %6s %5s %5s %5s %5s\n", "rank", "score",
+          "lap_ms", "lost", "home_mm", "ok", "speed", "thr", "kp", "ki", "kd");
+}
+
+// params.h with the best set, the other bands keep their gains
+static void write_params(FILE *f, const candidate *c) {
+  int b, band = pid_band(c->v[P_SPEED]);
+  fprintf(f, "////////////////////////////////////////////////////////////////\n"
+             "// Tuned constants for the track at hand.\n"
+             "// Written by sim/sweep: score %.2f over %d trials, lap %.0f ms,\n"
+             "// %.2f line losses, %.1f mm from home.\n\n",
+          c->score, c->trials, c->lap_ms, c->losses, c->home_mm);
+  fprintf(f, "#define BASE_SPEED %d // motor command when following a straight line\n",
+          c->v[P_SPEED]);
+  fprintf(f, "#define LINE_THRESHOLD %d // off the line below this %% of the sensor range\n\n",
+          c->v[P_THRESHOLD]);
+  fprintf(f, "// PID gains for the base speed bands in pid.h: {kp, ki, kd}\n"
+             "#define PID_BAND_GAINS { \\\n");
+  for (b = 0; b < BANDS; b++) {
+    if (b == band) fprintf(f, "\t{%d, %d, %d}, \\\n", c->v[P_KP], c->v[P_KI], c->v[P_KD]);
+    else fprintf(f, "\t{%d, %d, %d}, \\\n", pid_band_gains[b].kp, pid_band_gains[b].ki,
+                 pid_band_gains[b].kd);
+  }
+  fprintf(f, "}\n");
+}
+
+static void parse_param(char *arg) {
+  char *eq = strchr(arg, '=');
+  int i;
+  if (eq) *eq = 0;
+  for (i = 0; i < NPARAMS && strcmp(params[i].name, arg); i++) {}
+  if (!eq || i == NPARAMS) {
+    fprintf(stderr, "bad parameter '%s', use speed, threshold, kp, ki or kd=lo:hi[:step]\n", arg);
+    exit(1);
+  }
+  params[i].step = 1;
+  if (sscanf(eq + 1, "%d:%d:%d", &params[i].lo, &params[i].hi, &params[i].step) < 2 ||
+      params[i].step < 1 || params[i].hi < params[i].lo) {
+    fprintf(stderr, "bad range for %s\n", params[i].name);
+    exit(1);
+  }
+  params[i].on = 1;
+}
+
+int main(int argc, char **argv) {
+  static sim_track track;
+  int opt, i, n, g, generations = 0, population = 16, searched = 0;
+  const char *out_file = 0;
+  candidate *cands;
+
+  sim_config_default(&base_cfg);
+  base_cfg.finish = send_result;
+  jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  srand48(1);
+  while ((opt = getopt(argc, argv, "n:s:j:t:e:P:w:f:o:p:")) != -1) {
+    switch (opt) {
+    case 'n': seeds = atoi(optarg); break;
+    case 's': base_cfg.seed = strtoul(optarg, 0, 0); srand48(base_cfg.seed); break;
+    case 'j': jobs = atoi(optarg); break;
+    case 't': base_cfg.time_limit_ms = atof(optarg); break;
+    case 'e': generations = atoi(optarg); break;
+    case 'P': population = atoi(optarg); break;
+    case 'w': sscanf(optarg, "%lf:%lf:%lf", &w_lap, &w_loss, &w_home); break;
+    case 'f':
+      if (sim_track_load(&track, optarg)) return 1;
+      base_cfg.track = &track;
+      break;
+    case 'o': out_file = optarg; break;
+    case 'p': parse_param(optarg); searched++; break;
+    default:
+      fprintf(stderr, "usage: %s [-n seeds] [-s first_seed] [-j jobs] [-t limit_ms] "
+              "[-e generations] [-P population] [-w lap:loss:home] [-f track] [-o params.h] "
+              "-p name=lo:hi[:step] ...\n", argv[0]);
+      return 1;
+    }
+  }
+  if (!searched) {
+    fprintf(stderr, "nothing to search, give at least one -p\n");
+    return 1;
+  }
+  if (jobs < 1) jobs = 1;
+  if (jobs > 256) jobs = 256;
+  if (seeds < 1) seeds = 1;
+  if (population < 4) population = 4;
+
+  if (generations <= 0) {
+    n = grid_size();
+    fprintf(stderr, "grid of %d sets x %d seeds on %d jobs\n", n, seeds, jobs);
+    cands = calloc(n, sizeof(*cands));
+    for (i = 0; i < n; i++) grid_point(i, &cands[i]);
+    evaluate(cands, n);
+  } else {
+    int keep = population / 4;
+    n = population;
+    cands = calloc(n, sizeof(*cands));
+    // the built-in values and random sets to start with
+    defaults(&cands[0]);
+    for (i = 0; i < NPARAMS; i++) {
+      if (params[i].on) cands[0].v[i] = clamp_param(i, cands[0].v[i]);
+    }
+    complete(&cands[0]);
+    for (i = 1; i < n; i++) random_point(&cands[i]);
+    evaluate(cands, n);
+    for (g = 1; g < generations; g++) {
+      double spread = 0.25 / g; // narrow down as it converges
+      qsort(cands, n, sizeof(*cands), by_score);
+      fprintf(stderr, "generation %d best %.2f\n", g, cands[0].score);
+      for (i = keep; i < n; i++) mutate(&cands[(i - keep) % keep], &cands[i], spread);
+      evaluate(cands + keep, n - keep);
+    }
+  }
+  qsort(cands, n, sizeof(*cands), by_score);
+
+  print_header(stdout);
+  for (i = 0; i < n && i < 10; i++) print_candidate(stdout, i + 1, &cands[i]);
+
+  if (out_file) {
+    FILE *f = fopen(out_file, "w");
+    if (!f) {
+      perror(out_file);
+      return 1;
+    }
+    write_params(f, &cands[0]);
+    fclose(f);
+    fprintf(stderr, "wrote %s\n", out_file);
+  } else {
+    printf("\n");
+    write_params(stdout, &cands[0]);
+  }
+  return 0;
+}
@@ -0,0 +1,192 @@
+// Decodes the binary telemetry stream from telemetry.h into CSV.
+//
+// usage: teledecode [-p prefix] [capture]
+// Reads the capture (or stdin: the serial port itself works too, after
+// 'stty -F /dev/ttyUSB0 115200 raw') and writes one CSV row per control
+// step to stdout, or to prefix.csv along with a gnuplot script prefix.gp
+// that plots the path and the line position. Lost and corrupt frames
+// are counted on stderr, followed by the last profiler report (prof.h)
+// if the capture has one. The start frames are for sim/replay and
+// are skipped here.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STEP_TYPE 1
+#define STEP_SIZE 42
+#define PROFILE_TYPE 2
+#define PROFILE_SIZE 27
+#define START_TYPE 3
+#define START_SIZE 31
+#define WHEEL_TYPE 4
+#define WHEEL_SIZE 37
+#define MAP_TYPE 5
+#define MAP_SIZE 51
+#define GAINS_TYPE 6
+#define GAINS_SIZE 24
+#define PROF_STAGES 8
+#define PROF_BINS 8
+#define PROF_CYCLES 8
+#define MAX_FRAME 64
+
+static const char *prof_names[PROF_STAGES] = {
+  "step", "sensors", "position", "pid", "drive", "marks", "telemetry", "lcd"
+};
+
+static unsigned long u16(const unsigned char *p) { return p[0] | (unsigned long)p[1] << 8; }
+static long s16(const unsigned char *p) { return (short)u16(p); }
+static unsigned long u32(const unsigned char *p) { return u16(p) | u16(p + 2) << 16; }
+static long s32(const unsigned char *p) { return (long)(int)u32(p); }
+
+static int payload_size(int type) {
+  if (type == STEP_TYPE) return STEP_SIZE;
+  if (type == PROFILE_TYPE) return PROFILE_SIZE;
+  if (type == START_TYPE) return START_SIZE;
+  if (type == WHEEL_TYPE) return WHEEL_SIZE;
+  if (type == MAP_TYPE) return MAP_SIZE;
+  if (type == GAINS_TYPE) return GAINS_SIZE;
+  return -1;
+}
+
+// last report of each stage, as received
+static unsigned char profile[PROF_STAGES][PROFILE_SIZE];
+static int have_profile[PROF_STAGES];
+
+static void print_profile(FILE *f) {
+  int s, b;
+  fprintf(f, "%-10s %6s %8s %8s %8s  cycles <512 <1k <2k <4k <8k <16k <32k more\n",
+          "stage", "n", "min", "mean", "max");
+  for (s = 0; s < PROF_STAGES; s++) {
+    const unsigned char *p = profile[s];
+    unsigned long n = u16(p + 1);
+    if (!have_profile[s]) continue;
+    fprintf(f, "%-10s %6lu", prof_names[s], n);
+    if (n) {
+      fprintf(f, " %8lu %8.0f %8lu ", u16(p + 3) * PROF_CYCLES,
+              (double)u32(p + 7) * PROF_CYCLES / n, u16(p + 5) * PROF_CYCLES);
+    } else {
+      fprintf(f, " %8s %8s %8s ", "-", "-", "-");
+    }
+    for (b = 0; b < PROF_BINS; b++) fprintf(f, " %lu", u16(p + 11 + 2*b));
+    fprintf(f, "\n");
+  }
+}
+
+static void write_plot(const char *prefix) {
+  char name[512];
+  FILE *f;
+  snprintf(name, sizeof(name), "%s.gp", prefix);
+  f = fopen(name, "w");
+  if (!f) {
+    perror(name);
+    return;
+  }
+  fprintf(f, "set datafile separator ','\n"
+             "set key autotitle columnhead\n"
+             "set multiplot layout 1,2\n"
+             "set size ratio -1\n"
+             "set xlabel 'x (mm)'\n"
+             "set ylabel 'y (mm)'\n"
+             "plot '%s.csv' using 14:15 with lines title 'odometry'\n"
+             "set size noratio\n"
+             "set xlabel 'time (ms)'\n"
+             "set ylabel ''\n"
+             "plot '%s.csv' using 2:8 with lines, '' using 2:9 with lines\n"
+             "unset multiplot\n"
+             "pause mouse close\n", prefix, prefix);
+  fclose(f);
+}
+
+int main(int argc, char **argv) {
+  FILE *in = stdin, *out = stdout;
+  const char *prefix = 0;
+  unsigned char frame[MAX_FRAME];
+  int opt, c, len = 0, need = 0;
+  long frames = 0, bad = 0, lost = 0;
+  int last_seq = -1;
+  unsigned long last_ticks = 0;
+  int have_ticks = 0;
+  double time_ms = 0;
+
+  while ((opt = getopt(argc, argv, "p:")) != -1) {
+    if (opt == 'p') prefix = optarg;
+    else {
+      fprintf(stderr, "usage: %s [-p prefix] [capture]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind < argc && !(in = fopen(argv[optind], "rb"))) {
+    perror(argv[optind]);
+    return 1;
+  }
+  if (prefix) {
+    char name[512];
+    snprintf(name, sizeof(name), "%s.csv", prefix);
+    if (!(out = fopen(name, "w"))) {
+      perror(name);
+      return 1;
+    }
+    write_plot(prefix);
+  }
+
+  fprintf(out, "seq,time_ms,s0,s1,s2,s3,s4,position,offset,left,right,"
+               "x_tenth_mm,y_tenth_mm,x_mm,y_mm,theta_deg,tasks,buttons,battery_mv\n");
+  while ((c = getc(in)) != EOF) {
+    // hunt for the sync bytes, then collect a whole frame
+    if (len == 0 && c != 0xA5) continue;
+    if (len == 1 && c != 0x5A) {
+      len = (c == 0xA5) ? 1 : 0;
+      continue;
+    }
+    frame[len++] = c;
+    if (len == 3) {
+      int size = payload_size(c);
+      if (size < 0) {
+        bad++;
+        len = 0;
+        continue;
+      }
+      need = 4 + size + 1;
+    }
+    if (len < 4 || len < need) continue;
+
+    {
+      unsigned char sum = 0;
+      int i, seq = frame[3];
+      const unsigned char *p = frame + 4;
+      for (i = 2; i < need; i++) sum += frame[i];
+      len = 0;
+      if (sum != 0) {
+        bad++;
+        continue;
+      }
+      if (last_seq >= 0) lost += (seq - last_seq - 1) & 0xff;
+      last_seq = seq;
+      frames++;
+      if (frame[2] == PROFILE_TYPE) {
+        if (p[0] < PROF_STAGES) {
+          memcpy(profile[p[0]], p, PROFILE_SIZE);
+          have_profile[p[0]] = 1;
+        }
+        continue;
+      }
+      if (frame[2] != STEP_TYPE) continue;
+      if (have_ticks) time_ms += ((u32(p) - last_ticks) & 0xffffffffUL) * 0.0004;
+      have_ticks = 1;
+      last_ticks = u32(p);
+      fprintf(out, "%d,%.3f", seq, time_ms);
+      for (i = 0; i < 5; i++) fprintf(out, ",%lu", u16(p + 4 + 2*i));
+      fprintf(out, ",%ld,%ld,%ld,%ld,%ld,%ld,%.1f,%.1f,%.3f,%d,%d,%lu\n",
+              s16(p + 14), s16(p + 16), s16(p + 18), s16(p + 20),
+              s32(p + 22), s32(p + 26), s32(p + 22) / 10.0, s32(p + 26) / 10.0,
+              s32(p + 30) / 1000.0, p[38], p[39], u16(p + 40));
+    }
+  }
+
+  fprintf(stderr, "%ld frames, %ld lost, %ld corrupt, %.1f s", frames, lost, bad, time_ms / 1000);
+  if (time_ms > 0) fprintf(stderr, ", %.1f frames/s", frames * 1000 / time_ms);
+  fprintf(stderr, "\n");
+  print_profile(stderr);
+  return 0;
+}
@@ -0,0 +1,94 @@
+// Compares the quarter-wave trig in 3pi_kinematics.h with the
+// 360-entry degree tables it replaced: accuracy against libm as
+// the odometry uses them (heading in milli-degrees), host time per
+// call and the bytes of table each takes. Also checks Atan2Milli
+// against libm. The times are the host's, not the ATmega328P's.
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+#include "../3pi_kinematics.h"
+
+#define PI 3.14159265358979
+
+// The old tables, regenerated the way they were made:
+// (for (i 0 359) (printf "%d, " (+ 1000 (* 1000 (sin (* i (/ 3.1415927 180)))))))
+static int old_sin_table[360];
+static int old_cos_table[360];
+
+static long old_Sin(long angle) {
+  while (angle < 0) angle += 360;
+  return (long)(old_sin_table[angle % 360] - 1000);
+}
+
+static long old_Cos(long angle) {
+  while (angle < 0) angle += 360;
+  return (long)(old_cos_table[angle % 360] - 1000);
+}
+
+static double seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+volatile long sink;
+
+int main() {
+  long a;
+  int i;
+  double old_max = 0, new_max = 0, old_sq = 0, new_sq = 0, n = 0;
+  double t0, t_old, t_new;
+
+  for (i = 0; i < 360; i++) {
+    old_sin_table[i] = (int)(1000 + 1000 * sin(i * (3.1415927 / 180)));
+    old_cos_table[i] = (int)(1000 + 1000 * cos(i * (3.1415927 / 180)));
+  }
+
+  // every milli-degree over two turns either side of zero
+  for (a = -720000; a <= 720000; a++) {
+    double r = a * PI / 180000;
+    double eo = fabs(old_Sin(a/1000) / 1000.0 - sin(r));
+    double en = fabs(SinMilli(a) / (double)TRIG_ONE - sin(r));
+    double co = fabs(old_Cos(a/1000) / 1000.0 - cos(r));
+    double cn = fabs(CosMilli(a) / (double)TRIG_ONE - cos(r));
+    if (eo > old_max) old_max = eo;
+    if (co > old_max) old_max = co;
+    if (en > new_max) new_max = en;
+    if (cn > new_max) new_max = cn;
+    old_sq += eo*eo + co*co;
+    new_sq += en*en + cn*cn;
+    n += 2;
+  }
+
+  t0 = seconds();
+  for (a = -7200000; a < 7200000; a += 7) sink += old_Sin(a/1000) + old_Cos(a/1000);
+  t_old = seconds() - t0;
+  t0 = seconds();
+  for (a = -7200000; a < 7200000; a += 7) sink += SinMilli(a) + CosMilli(a);
+  t_new = seconds() - t0;
+
+  printf("%-28s %12s %12s %13s %12s\n", "", "max error", "rms error", "host ns/pair", "table bytes");
+  printf("%-28s %12.2e %12.2e %13.2f %12d\n", "Sin/Cos(alpha/1000)",
+         old_max, sqrt(old_sq / n), t_old * 1e9 / (14400000 / 7), 2 * 360 * 2);
+  printf("%-28s %12.2e %12.2e %13.2f %12d\n", "SinMilli/CosMilli(alpha)",
+         new_max, sqrt(new_sq / n), t_new * 1e9 / (14400000 / 7),
+         (int)sizeof(quarter_sin_table) / (int)sizeof(int) * 2);
+  {
+    // Atan2Milli around circles of a few radii, as the homing uses it
+    double at_max = 0;
+    long r;
+    for (r = 1000; r <= 1000000; r *= 10) {
+      for (i = 0; i < 36000; i++) {
+        double th = i * PI / 18000;
+        long x = lround(r * sin(th)), y = lround(r * cos(th));
+        double e = fabs(Atan2Milli(x, y) / 1000.0 - atan2(x, y) * 180 / PI);
+        if (e > 180) e = 360 - e;
+        if (e > at_max) at_max = e;
+      }
+    }
+    printf("%-28s %12.2e %12s %13s %12d\n", "Atan2Milli (deg, r>=1000)",
+           at_max, "", "", (int)sizeof(atan_table));
+  }
+  printf("old cost grows with negative angles (one loop pass per turn), new is constant\n");
+  return 0;
+}
@@ -0,0 +1,224 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+////////////////////////////////////////////////////////////////
+// Binary telemetry over the serial port (USART0, TX on PD1).
+// Frames are queued in a ring buffer and sent from the data register
+// empty interrupt, so queueing a frame costs a few microseconds and
+// never waits for the line. When a frame doesn't fit in the buffer
+// it is dropped whole; the sequence number shows the gap. Step frames
+// come first: a profile frame is only queued while there is room for
+// a step frame after it, and otherwise waits for a later try.
+//
+// Frame: 0xA5 0x5A, type, seq, payload, checksum. Multi-byte values
+// are little-endian. The checksum makes the bytes from type to
+// checksum sum to 0 (mod 256). sim/teledecode turns a capture into CSV.
+//
+// TELEMETRY_STEP payload (42 bytes), one frame per control step:
+//   ticks u32 (0.4 us, get_ticks() at the start of the step)
+//   sensors[5] u16, position i16, offset i16,
+//   left motor i16, right motor i16,
+//   xPos i32, yPos i32 (0.1 mm), theta i32 (milli-degrees, heading)
+// and the rest of what went into the step, for sim/replay:
+//   frame i16 (ticks the sensor frame was started at, from ticks)
+//   drive u16 (ticks the motors were last set at, from ticks)
+//   tasks u8 (sched_ran), buttons u8 (as check_buttons() last read them)
+//   battery u16 (mV, the last reading)
+// At 200 steps per second that is 82% of the line.
+//
+// TELEMETRY_PROFILE payload (27 bytes), one frame per prof.h stage
+// when a report is asked for:
+//   stage u8, n u16, min u16, max u16, sum u32 (in 8 cycle counts),
+//   hist[8] u16
+//
+// Once before the first step, the state the line following starts
+// from, so a replay can start there too:
+// TELEMETRY_START payload (31 bytes):
+//   ticks u32 (pose.h stamp), battery u16 (mV, filtered),
+//   learning u8 (map_learning), line_last i16,
+//   minv[5] u16, maxv[5] u16, width u16 (robot_width)
+// TELEMETRY_WHEEL payload (37 bytes), one per wheel:
+//   wheel u8, wheel_base[wheel][17] i16, tau u16 (wheel_tau_ms[wheel])
+// TELEMETRY_GAINS payload (24 bytes):
+//   pid_band_gains[4] (kp i16, ki i16, kd i16)
+// TELEMETRY_MAP payload (51 bytes), as many as the map takes:
+//   first u8 (run), n u8 (runs in the map), speed u8,
+//   runs[16] (steps u8, turn i16) from first on, zero past n
+
+#ifndef F_CPU
+#define F_CPU 20000000UL         // the 3pi runs at 20 MHz
+#endif
+#define TELEMETRY_BAUD 115200
+#define TELEMETRY_BUFFER 128     // power of two, holds two step frames
+#define TELEMETRY_STEP 1
+#define TELEMETRY_STEP_SIZE 42
+#define TELEMETRY_PROFILE 2
+#define TELEMETRY_PROFILE_SIZE 27
+#define TELEMETRY_START 3
+#define TELEMETRY_START_SIZE 31
+#define TELEMETRY_WHEEL 4
+#define TELEMETRY_WHEEL_SIZE 37
+#define TELEMETRY_MAP 5
+#define TELEMETRY_MAP_SIZE 51    // the largest
+#define TELEMETRY_MAP_RUNS 16
+#define TELEMETRY_GAINS 6
+#define TELEMETRY_GAINS_SIZE (6*PID_BANDS)
+
+unsigned char telemetry_buffer[TELEMETRY_BUFFER];
+volatile unsigned char telemetry_head;   // next byte written by the program
+volatile unsigned char telemetry_tail;   // next byte sent by the interrupt
+unsigned char telemetry_seq;
+unsigned int telemetry_dropped;          // frames that didn't fit
+
+// frame being assembled
+unsigned char telemetry_frame[4+TELEMETRY_MAP_SIZE+1];
+unsigned char telemetry_len;
+
+ISR(USART_UDRE_vect) {
+	unsigned char tail = telemetry_tail;
+	if (tail == telemetry_head) {
+		UCSR0B &= ~(1 << UDRIE0); // nothing left, stop interrupting
+		return;
+	}
+	UDR0 = telemetry_buffer[tail];
+	telemetry_tail = (tail+1) & (TELEMETRY_BUFFER-1);
+}
+
+// 8N1 at TELEMETRY_BAUD, double speed mode for a smaller rate error.
+void telemetry_init() {
+	UBRR0 = (F_CPU/4/TELEMETRY_BAUD - 1)/2;
+	UCSR0A = (1 << U2X0);
+	UCSR0C = (1 << UCSZ01) | (1 << UCSZ00);
+	UCSR0B = (1 << TXEN0);
+	telemetry_head = telemetry_tail = 0;
+	telemetry_dropped = 0;
+}
+
+void telemetry_put8(unsigned char b) { telemetry_frame[telemetry_len++] = b; }
+void telemetry_put16(unsigned int w) { telemetry_put8(w); telemetry_put8(w >> 8); }
+void telemetry_put32(unsigned long l) { telemetry_put16(l); telemetry_put16(l >> 16); }
+
+void telemetry_begin(unsigned char type) {
+	telemetry_len = 0;
+	telemetry_put8(0xA5);
+	telemetry_put8(0x5A);
+	telemetry_put8(type);
+	telemetry_put8(telemetry_seq++);
+}
+
+// Bytes free in the buffer
+unsigned char telemetry_room() {
+	return (telemetry_tail - telemetry_head - 1) & (TELEMETRY_BUFFER-1);
+}
+
+// Adds the checksum and queues the frame, or drops it if it doesn't fit.
+unsigned char telemetry_end() {
+	unsigned char i, sum = 0, head = telemetry_head;
+	unsigned char space = telemetry_room();
+	for (i=2; i<telemetry_len; i++) { sum += telemetry_frame[i]; }
+	telemetry_put8(-sum);
+	if (telemetry_len > space) {
+		telemetry_dropped++;
+		return 0;
+	}
+	for (i=0; i<telemetry_len; i++) {
+		telemetry_buffer[head] = telemetry_frame[i];
+		head = (head+1) & (TELEMETRY_BUFFER-1);
+	}
+	telemetry_head = head;
+	UCSR0B |= (1 << UDRIE0);
+	return 1;
+}
+
+// Waits for room for a frame with size bytes of payload.
+void telemetry_wait(unsigned char size) {
+	while (telemetry_room() < 5 + size) { delay_ms(1); }
+}
+
+void telemetry_step(unsigned long ticks, unsigned long frame, unsigned long drive,
+                    unsigned char tasks, unsigned char buttons, unsigned int battery,
+                    const unsigned int *s, int position, int offset,
+                    int left, int right, long x, long y, long theta) {
+	unsigned char i;
+	telemetry_begin(TELEMETRY_STEP);
+	telemetry_put32(ticks);
+	for (i=0; i<5; i++) { telemetry_put16(s[i]); }
+	telemetry_put16(position);
+	telemetry_put16(offset);
+	telemetry_put16(left);
+	telemetry_put16(right);
+	telemetry_put32(x);
+	telemetry_put32(y);
+	telemetry_put32(theta);
+	telemetry_put16(frame - ticks);
+	telemetry_put16(drive - ticks);
+	telemetry_put8(tasks);
+	telemetry_put8(buttons);
+	telemetry_put16(battery);
+	telemetry_end();
+}
+
+// The start frames, waiting for room for each: they are sent once,
+// before the control loop, and a replay can't do without them.
+void telemetry_start(const unsigned int *minv, const unsigned int *maxv, int line_last) {
+	unsigned char i, w, first = 0;
+	telemetry_wait(TELEMETRY_START_SIZE);
+	telemetry_begin(TELEMETRY_START);
+	telemetry_put32(pose_stamp);
+	telemetry_put16(battery_mv);
+	telemetry_put8(map_learning);
+	telemetry_put16(line_last);
+	for (i=0; i<5; i++) { telemetry_put16(minv[i]); }
+	for (i=0; i<5; i++) { telemetry_put16(maxv[i]); }
+	telemetry_put16(robot_width);
+	telemetry_end();
+	for (w=0; w<2; w++) {
+		telemetry_wait(TELEMETRY_WHEEL_SIZE);
+		telemetry_begin(TELEMETRY_WHEEL);
+		telemetry_put8(w);
+		for (i=0; i<WHEEL_POINTS; i++) { telemetry_put16(wheel_base[w][i]); }
+		telemetry_put16(wheel_tau_ms[w]);
+		telemetry_end();
+	}
+	telemetry_wait(TELEMETRY_GAINS_SIZE);
+	telemetry_begin(TELEMETRY_GAINS);
+	for (i=0; i<PID_BANDS; i++) {
+		telemetry_put16(pid_band_gains[i].kp);
+		telemetry_put16(pid_band_gains[i].ki);
+		telemetry_put16(pid_band_gains[i].kd);
+	}
+	telemetry_end();
+	do {
+		telemetry_wait(TELEMETRY_MAP_SIZE);
+		telemetry_begin(TELEMETRY_MAP);
+		telemetry_put8(first);
+		telemetry_put8(map.n);
+		telemetry_put8(map.speed);
+		for (i=first; i<first+TELEMETRY_MAP_RUNS; i++) {
+			telemetry_put8((i < map.n) ? map.runs[i].steps : 0);
+			telemetry_put16((i < map.n) ? map.runs[i].turn : 0);
+		}
+		telemetry_end();
+		first += TELEMETRY_MAP_RUNS;
+	} while (first < map.n);
+	// and for all of it to go: the first steps come back to back
+	while (telemetry_tail != telemetry_head) { delay_ms(1); }
+}
+
+#if PROFILE
+// Returns 0 if the frame wasn't queued, to be tried again later: not
+// before there is room for the next step frame after it.
+unsigned char telemetry_profile(unsigned char stage) {
+	const prof_stage *p = &prof_stages[stage];
+	unsigned char i;
+	if (telemetry_room() < 5 + TELEMETRY_PROFILE_SIZE + 5 + TELEMETRY_STEP_SIZE) { return 0; }
+	telemetry_begin(TELEMETRY_PROFILE);
+	telemetry_put8(stage);
+	telemetry_put16(p->n);
+	telemetry_put16(p->min);
+	telemetry_put16(p->max);
+	telemetry_put32(p->sum);
+	for (i=0; i<PROF_BINS; i++) { telemetry_put16(p->hist[i]); }
+	return telemetry_end();
+}
+#endif
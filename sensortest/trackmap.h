@@ -0,0 +1,172 @@
+#include <stddef.h>
+#include <avr/eeprom.h>
+
+////////////////////////////////////////////////////////////////
+// Learned track map and speed profile.
+// A learn lap, at the usual base speed, records how far the heading
+// turns over every MAP_STEP of odometric distance. Steps that turn
+// about as much as the run before them join it (run-length encoding),
+// so a straight or an arc of any length is a single entry, and the
+// map is kept in EEPROM after the calibration.
+// Later laps look the distance driven up in the map: straights are
+// driven at MAP_FAST_SPEED, curves at the speed the map was learnt
+// at, and gentle ones in between. Curves ahead (and the end of the
+// line) are braked for along a ramp of one command per
+// 2^MAP_BRAKE_SHIFT of distance that ends MAP_MARGIN before them, for
+// the odometry drifting by a percent or two over a lap; the speed only
+// rises by MAP_ACCEL per step. The speeds are worked out when the map
+// is loaded, a step only walks the runs within braking distance.
+
+#ifndef MAP_FAST_SPEED
+#define MAP_FAST_SPEED 150      // motor command on straights
+#endif
+#define MAP_STEP 200            // 0.1 mm of travel per map step
+#define MAP_RUNS 48
+#define MAP_TURN_SHIFT 7        // map_run.turn is in 128 milli-degree units
+#define MAP_TOL 24              // turn units a step may differ from its run's mean
+#define MAP_STRAIGHT 8          // turn units per step still straight (1 degree)
+#define MAP_CURVE 32            // and from where on a curve is taken at the learnt speed
+#define MAP_BRAKE_SHIFT 3       // one command per 0.8 mm
+#define MAP_MARGIN 600          // 0.1 mm
+#define MAP_ACCEL 2             // commands per control step
+
+#define MAP_ADDR ((void *)((char *)CALSTORE_ADDR + sizeof(calstore_record)))
+#define MAP_MAGIC 0x6d70        // "pm"
+#define MAP_VERSION 1
+
+typedef struct {
+	unsigned char steps;        // MAP_STEPs, 1-255
+	int turn;                   // heading change over all of them, clockwise
+} map_run;
+
+// the map as it is saved
+typedef struct {
+	unsigned int magic;
+	unsigned char version;
+	unsigned int size;          // sizeof(map_record)
+	unsigned char n;            // runs in use
+	unsigned char speed;        // base speed it was learnt at
+	map_run runs[MAP_RUNS];
+	unsigned int check;         // Fletcher-16, see calstore.h
+} map_record;
+
+map_record map;
+unsigned char map_cmd[MAP_RUNS]; // speed for each run, from map_plan()
+unsigned char map_learning;     // recording the map on this lap
+
+// learning
+long map_next;                  // distance the current step ends at
+long map_theta;                 // heading it started with, milli-degrees
+
+// following
+unsigned char map_at;           // run the robot is in
+long map_at_end;                // distance it ends at
+int map_base;                   // last speed given
+
+// Speeds for the runs.
+void map_plan() {
+	unsigned char i;
+	int k, v;
+	for (i=0; i<map.n; i++) {
+		k = ((map.runs[i].turn < 0) ? -map.runs[i].turn : map.runs[i].turn)/map.runs[i].steps;
+		if (k <= MAP_STRAIGHT) { v = MAP_FAST_SPEED; }
+		else if (k >= MAP_CURVE) { v = map.speed; }
+		else { v = MAP_FAST_SPEED - (long)(MAP_FAST_SPEED - map.speed)*(k - MAP_STRAIGHT)/(MAP_CURVE - MAP_STRAIGHT); }
+		map_cmd[i] = (v > map.speed) ? v : map.speed;
+	}
+	map_at = 0;
+	map_at_end = map.n ? (long)map.runs[0].steps*MAP_STEP : 0;
+	map_base = map.speed;
+}
+
+// Starts recording, from the start of the pose.
+void map_learn_start() {
+	map.n = 0;
+	map_learning = 1;
+	map_next = MAP_STEP;
+	map_theta = 0;
+}
+
+// Takes the pose after a step: distance driven, heading in milli-degrees.
+void map_learn(long dist, long heading) {
+	long turn;
+	map_run *r;
+	int t;
+	if (!map_learning || dist < map_next) { return; }
+	turn = heading - map_theta;
+	if (turn > 180000) { turn -= 360000L; }
+	if (turn < -180000) { turn += 360000L; }
+	map_theta = heading;
+	map_next += MAP_STEP;
+	t = turn >> MAP_TURN_SHIFT;
+	if (map.n) {
+		// joins the last run if it is within MAP_TOL of its mean
+		r = &map.runs[map.n-1];
+		turn = (long)t*r->steps - r->turn;
+		if (r->steps < 255 && turn <= (long)MAP_TOL*r->steps && turn >= -(long)MAP_TOL*r->steps
+		    && r->turn + (long)t < 30000 && r->turn + (long)t > -30000) {
+			r->steps++;
+			r->turn += t;
+			return;
+		}
+	}
+	if (map.n == MAP_RUNS) {    // too much to remember: no map
+		map.n = 0;
+		map_learning = 0;
+		return;
+	}
+	r = &map.runs[map.n++];
+	r->steps = 1;
+	r->turn = t;
+}
+
+// The learn lap is over, at the end of the line, driven at speed.
+void map_learn_done(int speed) {
+	if (!map_learning) { return; }
+	map_learning = 0;
+	map.speed = speed;
+	map_plan();
+}
+
+// Base speed for the distance driven so far.
+int map_profile(long dist) {
+	unsigned char j;
+	long ahead, a;
+	int v, w;
+	while (map_at < map.n && dist >= map_at_end) {
+		if (++map_at < map.n) { map_at_end += (long)map.runs[map_at].steps*MAP_STEP; }
+	}
+	v = (map_at < map.n) ? map_cmd[map_at] : map.speed;
+	ahead = map_at_end - dist;
+	for (j=map_at+1; j<=map.n; j++) {
+		a = ahead - MAP_MARGIN;
+		if (a > (255L << MAP_BRAKE_SHIFT)) { break; }  // out of reach of any braking
+		w = (j < map.n) ? map_cmd[j] : map.speed;       // past the last run, the end of the line
+		if (a > 0) { w += a >> MAP_BRAKE_SHIFT; }
+		if (w < v) { v = w; }
+		if (j < map.n) { ahead += (long)map.runs[j].steps*MAP_STEP; }
+	}
+	if (v > map_base + MAP_ACCEL) { v = map_base + MAP_ACCEL; }
+	map_base = v;
+	return v;
+}
+
+// Loads the saved map and plans the speeds, returns 0 if there is none.
+unsigned char map_load() {
+	eeprom_read_block(&map, MAP_ADDR, sizeof(map));
+	if (map.magic != MAP_MAGIC || map.version != MAP_VERSION || map.size != sizeof(map)
+	    || map.n == 0 || map.n > MAP_RUNS || map.check != calstore_sum(&map, offsetof(map_record, check))) {
+		map.n = 0;
+		return 0;
+	}
+	map_plan();
+	return 1;
+}
+
+void map_save() {
+	map.magic = MAP_MAGIC;
+	map.version = MAP_VERSION;
+	map.size = sizeof(map);
+	map.check = calstore_sum(&map, offsetof(map_record, check));
+	eeprom_update_block(&map, MAP_ADDR, sizeof(map));
+}